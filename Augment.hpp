@@ -0,0 +1,48 @@
+#pragma once
+
+// augmentations of RBTree / LLRB: every node keeps the fold of a monoid
+// over the (key, val) of its subtree, in ascending order of key
+//   value_type, identity(), lift(key, val), combine(a, b)
+
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+//! no augmentation; nodes carry nothing and nothing is recomputed
+struct NoAugment {
+  static constexpr bool enabled = false;
+  struct value_type {};
+};
+
+//! sum of values, for range sums (S: the type of sums)
+template <typename K, typename V, typename S = V>
+struct SumAugment {
+  static constexpr bool enabled = true;
+  using value_type = S;
+  static value_type identity() { return S(); }
+  static value_type lift(const K&, const V& v) { return v; }
+  static value_type combine(const value_type& a, const value_type& b) {
+    return a + b;
+  }
+};
+
+//! keys are closed intervals (lo, hi); keeps the max hi of the subtree
+template <typename T, typename V>
+struct IntervalAugment {
+  static constexpr bool enabled = true;
+  using value_type = T;
+  static value_type identity() { return std::numeric_limits<T>::lowest(); }
+  static value_type lift(const std::pair<T, T>& k, const V&) {
+    return k.second;
+  }
+  static value_type combine(const value_type& a, const value_type& b) {
+    return std::max(a, b);
+  }
+};
+
+//! whether Aug is an IntervalAugment, which for_each_overlap() needs
+template <typename Aug>
+struct is_interval_augment : std::false_type {};
+template <typename T, typename V>
+struct is_interval_augment<IntervalAugment<T, V>> : std::true_type {};
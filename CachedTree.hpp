@@ -0,0 +1,131 @@
+#pragma once
+
+// small set-associative hot-key cache in front of find()
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include "Tree.hpp"
+
+struct CacheStats {
+  std::size_t hits = 0;
+  std::size_t misses = 0;
+  std::size_t bypassed = 0;  // lookups sent to the tree without probing
+
+  double hit_rate() const {
+    return hits + misses ? hits * 1. / (hits + misses) : 0.;
+  }
+};
+
+template <template <typename...> class T, typename K, typename V>
+class CachedTree : public TreeAbst<K, V> {
+ private:
+  static constexpr int WAYS = 4;
+
+  // one set fits in a cache line for small K, V
+  // replacement within a set is CLOCK
+  struct alignas(64) Set {
+    K keys[WAYS];
+    V vals[WAYS];
+    std::uint8_t valid = 0;  // bitmask of ways
+    std::uint8_t ref = 0;    // bitmask: referenced since the hand passed
+    std::uint8_t hand = 0;
+  };
+
+  // self tuning: every WINDOW probes, if the hit rate of the window is
+  // below min_hit_rate, finds skip the cache for the next BYPASS lookups
+  static constexpr std::size_t WINDOW = 1 << 12;
+  static constexpr std::size_t BYPASS = 1 << 16;
+
+  T<K, V> tree;
+  std::size_t set_num;
+  std::unique_ptr<Set[]> sets;
+  double min_hit_rate;
+  CacheStats st;
+  std::size_t win_probes = 0, win_hits = 0, bypass_left = 0;
+
+  Set& set_of(const K& key) { return sets[mix_hash(key) % set_num]; }
+
+  int way_of(const Set& s, const K& key) const {
+    for (int w = 0; w < WAYS; ++w)
+      if ((s.valid >> w & 1) && s.keys[w] == key) return w;
+    return -1;
+  }
+
+  void fill(Set& s, const K& key, const V& val) {
+    int w = 0;
+    while (w < WAYS && (s.valid >> w & 1)) ++w;
+    if (w == WAYS) {
+      while (s.ref >> s.hand & 1) {
+        s.ref &= ~(1 << s.hand);
+        s.hand = (s.hand + 1) % WAYS;
+      }
+      w = s.hand;
+      s.hand = (s.hand + 1) % WAYS;
+    }
+    s.keys[w] = key;
+    s.vals[w] = val;
+    s.valid |= 1 << w;
+    s.ref &= ~(1 << w);
+  }
+
+  void tune(bool hit) {
+    ++win_probes;
+    win_hits += hit;
+    if (win_probes < WINDOW) return;
+    if (win_hits < min_hit_rate * win_probes) bypass_left = BYPASS;
+    win_probes = win_hits = 0;
+  }
+
+ public:
+  //! capacity is WAYS * sets keys; min_hit_rate = 0 never bypasses
+  explicit CachedTree(std::size_t sets = 1024, double min_hit_rate = 0.05)
+      : set_num(sets ? sets : 1),
+        sets(new Set[set_num]),
+        min_hit_rate(min_hit_rate) {}
+
+  void insert(const K& key, const V& val) {
+    tree.insert(key, val);
+    Set& s = set_of(key);
+    int w = way_of(s, key);
+    if (w >= 0) s.vals[w] = val;
+  }
+
+  void erase(const K& key) {
+    tree.erase(key);
+    Set& s = set_of(key);
+    int w = way_of(s, key);
+    if (w >= 0) s.valid &= ~(1 << w);
+  }
+
+  bool find(const K& key, V& res) {
+    if (bypass_left) {
+      --bypass_left;
+      ++st.bypassed;
+      return tree.find(key, res);
+    }
+
+    Set& s = set_of(key);
+    int w = way_of(s, key);
+    tune(w >= 0);
+    if (w >= 0) {
+      ++st.hits;
+      s.ref |= 1 << w;
+      res = s.vals[w];
+      return true;
+    }
+
+    ++st.misses;
+    if (!tree.find(key, res)) return false;
+    fill(s, key, res);
+    return true;
+  }
+
+  const CacheStats& stats() const { return st; }
+  void reset_stats() { st = CacheStats(); }
+
+  template <typename F>
+  void for_each(F f) {
+    tree.for_each(f);
+  }
+};
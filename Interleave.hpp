@@ -0,0 +1,136 @@
+#pragma once
+
+// interleaved lookups with C++20 coroutines: a lookup prefetches the node
+// it is about to read and suspends, so that other lookups run while the
+// cache line is being loaded
+// RBTree / LLRB provide find_async() only where coroutines are supported
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+#include <vector>
+
+// frames of suspended lookups are recycled: a scheduler keeps creating
+// coroutines of the same frame size
+struct FramePool {
+  std::size_t size = 0;
+  std::vector<void*> blocks;
+
+  ~FramePool() {
+    for (void* p : blocks) ::operator delete(p);
+  }
+
+  void* allocate(std::size_t n) {
+    if (n != size || blocks.empty()) return ::operator new(n);
+    void* p = blocks.back();
+    blocks.pop_back();
+    return p;
+  }
+
+  void deallocate(void* p, std::size_t n) {
+    if (size == 0) size = n;
+    if (n == size)
+      blocks.push_back(p);
+    else
+      ::operator delete(p);
+  }
+};
+
+inline FramePool& frame_pool() {
+  thread_local FramePool pool;
+  return pool;
+}
+
+//! a lookup in flight: started and continued by resume(), bool result
+class FindTask {
+ public:
+  struct promise_type {
+    bool value = false;
+
+    static void* operator new(std::size_t n) {
+      return frame_pool().allocate(n);
+    }
+    static void operator delete(void* p, std::size_t n) {
+      frame_pool().deallocate(p, n);
+    }
+
+    FindTask get_return_object() {
+      return FindTask(handle::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_value(bool v) { value = v; }
+    void unhandled_exception() { std::terminate(); }
+  };
+  using handle = std::coroutine_handle<promise_type>;
+
+ private:
+  handle h;
+
+ public:
+  FindTask() : h(nullptr) {}
+  explicit FindTask(handle h) : h(h) {}
+  FindTask(FindTask&& t) noexcept : h(std::exchange(t.h, nullptr)) {}
+  FindTask& operator=(FindTask&& t) noexcept {
+    if (h) h.destroy();
+    h = std::exchange(t.h, nullptr);
+    return *this;
+  }
+  ~FindTask() {
+    if (h) h.destroy();
+  }
+
+  explicit operator bool() const { return bool(h); }
+  bool done() const { return h.done(); }
+  void resume() { h.resume(); }
+  bool result() const { return h.promise().value; }
+};
+
+//! co_await Prefetch{p}: prefetch p, then give way to the other lookups
+struct Prefetch {
+  const void* p;
+
+  bool await_ready() const noexcept {
+    __builtin_prefetch(p);
+    return false;
+  }
+  void await_suspend(std::coroutine_handle<>) const noexcept {}
+  void await_resume() const noexcept {}
+};
+
+/**
+ *  look up keys[0, n) with `width` lookups in flight, switching between
+ *  them round robin; res[i] and found[i] receive the results
+ *  returns the number of keys found
+ */
+template <typename Tree, typename K, typename V>
+std::size_t find_interleaved(Tree& tree, const K* keys, std::size_t n,
+                             V* res, bool* found, std::size_t width) {
+  std::vector<FindTask> tasks(width);
+  std::vector<std::size_t> idx(width);
+  std::size_t next = 0, active = 0, hits = 0;
+  for (std::size_t s = 0; s < width && next < n; ++s, ++next, ++active) {
+    tasks[s] = tree.find_async(keys[next], res[next]);
+    idx[s] = next;
+  }
+
+  while (active) {
+    for (std::size_t s = 0; s < width; ++s) {
+      FindTask& t = tasks[s];
+      if (!t) continue;
+      t.resume();
+      if (!t.done()) continue;
+
+      hits += found[idx[s]] = t.result();
+      if (next < n) {
+        t = tree.find_async(keys[next], res[next]);
+        idx[s] = next++;
+      } else {
+        t = FindTask();
+        --active;
+      }
+    }
+  }
+  return hits;
+}
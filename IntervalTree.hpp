@@ -0,0 +1,13 @@
+#pragma once
+
+// interval tree: RBTree keyed by closed intervals (lo, hi), ordered
+// lexicographically, augmented with the max hi of each subtree
+//   for_each_overlap(lo, hi, f) visits every interval intersecting [lo, hi]
+
+#include <utility>
+#include "Augment.hpp"
+#include "RBTree.hpp"
+
+template <typename T, typename V, typename Storage = HeapStorage>
+using IntervalTree =
+    RBTree<std::pair<T, T>, V, Storage, IntervalAugment<T, V>>;
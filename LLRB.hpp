@@ -2,36 +2,80 @@
 
 // ref https://www.cs.princeton.edu/~rs/talks/LLRB/RedBlack.pdf
 
+#include <cassert>
+#include <algorithm>
 #include <functional>
+#include <memory>
+#include <optional>
+#include <stack>
 #include <string>
+#include <utility>
+#include <vector>
+#include "Augment.hpp"
+#include "NodeStorage.hpp"
 #include "Tree.hpp"
+#if __cpp_impl_coroutine
+#include "Interleave.hpp"
+#endif
 
-template <typename K, typename V>
+template <typename K, typename V, typename Storage = HeapStorage,
+          typename Aug = NoAugment>
 class LLRB : public TreeAbst<K, V> {
  private:
+  using Agg = typename Aug::value_type;
+
   struct Node {
     K key;
     V val;
     bool red;
+    [[no_unique_address]] Agg agg;  // fold of Aug over this subtree
     Node* left;
     Node* right;
 
     Node(const K& k, const V& v, bool red = true, Node* l = nullptr,
          Node* r = nullptr)
         : key(k), val(v), red(red), left(l), right(r) {}
-    ~Node() {
-      delete left;
-      left = nullptr;
-      delete right;
-      right = nullptr;
-    }
   };
+
+  Storage storage;
+
+  template <typename... Args>
+  Node* new_node(Args&&... args) {
+    return new (storage.allocate(sizeof(Node)))
+        Node(std::forward<Args>(args)...);
+  }
+
+  void delete_node(Node* u) {
+    u->~Node();
+    // blocks of regions are reclaimed with the region
+    if (region && region->owns(u)) {
+      region->deallocate(u);
+      return;
+    }
+    if (next_region && next_region->owns(u)) {
+      next_region->deallocate(u);
+      return;
+    }
+    storage.deallocate(u, sizeof(Node));
+  }
+
   bool isRed(const Node* u) {
     return u ? u->red : false;  // all leaves (NIL) is black
   }
 
   bool isBlack(const Node* u) { return !isRed(u); }
 
+  Agg agg_of(const Node* u) { return u ? u->agg : Aug::identity(); }
+
+  // recompute the aggregate of u from its children
+  Node* pull(Node* u) {
+    if constexpr (Aug::enabled)
+      u->agg = Aug::combine(
+          Aug::combine(agg_of(u->left), Aug::lift(u->key, u->val)),
+          agg_of(u->right));
+    return u;
+  }
+
   std::string dump_dot(std::function<std::string(const K&)> k2s,
                        std::function<std::string(const V&)> v2s, Node* root) {
     auto n2s = [&](Node* n) {
@@ -63,6 +107,41 @@ class LLRB : public TreeAbst<K, V> {
   }
 
   Node* root = nullptr;
+  std::size_t count = 0;
+
+  // compact(): nodes laid out in DFS order, and the pass in progress
+  // (regions come from storage, so they are declared after it)
+  // (the stack holds the links to the nodes to visit)
+  std::unique_ptr<NodeRegion<Storage>> region, next_region;
+  std::vector<Node**> compact_stack;
+  std::optional<K> compact_cursor;  // key of the last visited node
+  bool compact_restart = false;
+
+  // a mutation between two compact_step() invalidates compact_stack
+  void touch() {
+    if (next_region) compact_restart = true;
+  }
+
+  // rebuild compact_stack as the preorder walk stands after compact_cursor
+  void compact_resume() {
+    if (!compact_cursor) {
+      compact_stack.push_back(&root);
+      return;
+    }
+    const K& k = *compact_cursor;
+    for (Node* u = root; u;) {
+      if (k < u->key) {
+        if (u->right) compact_stack.push_back(&u->right);
+        u = u->left;
+      } else if (u->key < k) {
+        u = u->right;
+      } else {
+        if (u->right) compact_stack.push_back(&u->right);
+        if (u->left) compact_stack.push_back(&u->left);
+        return;
+      }
+    }
+  }
 
   // precondition: h->right->red == true
   Node* rotateLeft(Node* u) {
@@ -71,8 +150,9 @@ class LLRB : public TreeAbst<K, V> {
     r->left = u;
     r->red = u->red;
     u->red = true;
+    pull(u);
 
-    return r;
+    return pull(r);
   }
 
   // precondition: h->left->red == true
@@ -82,8 +162,9 @@ class LLRB : public TreeAbst<K, V> {
     l->right = u;
     l->red = u->red;
     u->red = true;
+    pull(u);
 
-    return l;
+    return pull(l);
   }
 
   void flipColors(Node* u) {
@@ -95,7 +176,10 @@ class LLRB : public TreeAbst<K, V> {
   }
 
   Node* insert(Node* u, const K& key, const V& val) {
-    if (!u) return new Node(key, val);
+    if (!u) {
+      ++count;
+      return pull(new_node(key, val));
+    }
 
     if (key < u->key)
       u->left = insert(u->left, key, val);
@@ -108,7 +192,7 @@ class LLRB : public TreeAbst<K, V> {
     if (isRed(u->left) && isRed(u->left->left)) u = rotateRight(u);
     if (isRed(u->left) && isRed(u->right)) flipColors(u);
 
-    return u;
+    return pull(u);
   }
 
   Node* fixup(Node* u) {
@@ -116,7 +200,7 @@ class LLRB : public TreeAbst<K, V> {
     if (isRed(u->left) && isRed(u->left->left)) u = rotateRight(u);
     if (isRed(u->left) && isRed(u->right)) flipColors(u);
 
-    return u;
+    return pull(u);
   }
 
   // precondition:
@@ -154,7 +238,8 @@ class LLRB : public TreeAbst<K, V> {
   // invariant: isRed(h) || isRed(h->left)
   Node* deleteMin(Node* h) {
     if (h->left == nullptr) {
-      delete h;
+      --count;
+      delete_node(h);
       return nullptr;
     }
 
@@ -169,6 +254,9 @@ class LLRB : public TreeAbst<K, V> {
   // invariant: (isRed(h) || isRed(h->left) || isRed(h->right))
   Node* erase(Node* h, const K& key) {
     if (key < h->key) {  // left
+      if (h->left == nullptr) {  // key is not found
+        return fixup(h);
+      }
       if (isRed(h->left) || isRed(h->left->left)) {
         // already invariant holds.
         h->left = erase(h->left, key);
@@ -185,7 +273,8 @@ class LLRB : public TreeAbst<K, V> {
       // else isRed(h) holds
 
       if (key == h->key && h->right == nullptr) {
-        delete h;
+        --count;
+        delete_node(h);
         return nullptr;
       }
 
@@ -201,37 +290,178 @@ class LLRB : public TreeAbst<K, V> {
         h->key = succ->key;
         h->val = succ->val;
         h->right = deleteMin(h->right);
-      } else
+      } else if (h->right) {
         h->right = erase(h->right, key);
+      }  // else key is not found
     }
 
     return fixup(h);
   }
 
-  bool check_blackheight() {
-    int c = 0;
-    auto u = root;
-    while (u != nullptr) {
-      if (!u->red) ++c;
-      u = u->left;
+  // relink a[0..n) into a 2-3 shaped tree of capacity cap (= 3^h - 1)
+  // (3-node: black node with red left child)
+  // precondition: 2^h - 1 <= n <= cap
+  Node* build(Node** a, std::size_t n, std::size_t cap) {
+    if (n == 0) return nullptr;
+    std::size_t c = (cap - 2) / 3;
+
+    if (n - 1 <= 2 * c) {  // 2-node
+      std::size_t l = (n - 1) / 2;
+      Node* u = a[l];
+      u->red = false;
+      u->left = build(a, l, c);
+      u->right = build(a + l + 1, n - 1 - l, c);
+      return pull(u);
     }
 
-    std::function<bool(Node*, int)> dfs = [&](Node* u, int c) {
-      if (u == nullptr) return c == 0;
-      if (!u->red) --c;
-      return dfs(u->left, c) && dfs(u->right, c);
-    };
+    // 3-node
+    std::size_t m = n - 2, p = m / 3, q = (m - p) / 2;
+    Node* v = a[p];
+    v->red = true;
+    v->left = build(a, p, c);
+    v->right = build(a + p + 1, q, c);
+    pull(v);
+
+    Node* u = a[p + 1 + q];
+    u->red = false;
+    u->left = v;
+    u->right = build(a + p + q + 2, m - p - q, c);
+    return pull(u);
+  }
 
-    return dfs(root, c);
+  // links from the root down to the lowest black node whose subtree spans
+  // the keys of ops; precondition: ops is sorted and not empty
+  std::vector<Node**> batch_span(const std::vector<BatchOp<K, V>>& ops) {
+    const K& lo = ops.front().key;
+    const K& hi = ops.back().key;
+    std::vector<Node**> path{&root};
+    while (Node* s = *path.back()) {
+      if (hi < s->key && s->left)
+        path.push_back(&s->left);
+      else if (s->key < lo && s->right)
+        path.push_back(&s->right);
+      else
+        break;
+    }
+    while (isRed(*path.back())) path.pop_back();
+    return path;
+  }
+
+  // size of the subtree of u, counted up to limit + 1
+  std::size_t subtree_size(Node* u, std::size_t limit) {
+    std::size_t n = 0;
+    std::vector<Node*> st;
+    if (u) st.push_back(u);
+    while (!st.empty() && n <= limit) {
+      u = st.back();
+      st.pop_back();
+      ++n;
+      if (u->left) st.push_back(u->left);
+      if (u->right) st.push_back(u->right);
+    }
+    return n;
+  }
+
+  // merge ops into the nodes of the subtree at the end of path and build
+  // it again. the subtree keeps its black height, so climbs to a larger
+  // one while the merged size does not fit it (up to the whole tree)
+  // precondition: *path.back() is black and spans the keys of ops
+  void rebuild(std::vector<Node**> path,
+               const std::vector<BatchOp<K, V>>& ops) {
+    std::vector<Node*> olds;
+    std::size_t n, cap = 0;
+    while (true) {
+      olds.clear();
+      for_each_node(*path.back(), [&](Node* u) { olds.push_back(u); });
+
+      n = olds.size();
+      auto u = olds.begin();
+      for (const auto& op : ops) {
+        while (u != olds.end() && (*u)->key < op.key) ++u;
+        bool hit = (u != olds.end() && !(op.key < (*u)->key));
+        if (op.type == BatchOp<K, V>::Type::Insert)
+          n += !hit;
+        else
+          n -= hit;
+      }
+      if (path.size() == 1) break;
+
+      // a 2-3 shaped tree of black height h holds 2^h - 1 to 3^h - 1 nodes
+      std::size_t lo = 1;
+      cap = 2;
+      for (Node* u = (*path.back())->left; u; u = u->left) {
+        if (u->red) continue;
+        lo = lo * 2 + 1;
+        cap = cap * 3 + 2;
+      }
+      if (lo <= n && n <= cap) break;
+      do {
+        path.pop_back();
+      } while (isRed(*path.back()));
+    }
+
+    std::vector<Node*> nodes;
+    nodes.reserve(n);
+    auto u = olds.begin();
+    auto it = ops.begin();
+    while (u != olds.end() || it != ops.end()) {
+      if (it == ops.end() || (u != olds.end() && (*u)->key < it->key)) {
+        nodes.push_back(*u++);
+        continue;
+      }
+      bool hit = (u != olds.end() && !(it->key < (*u)->key));
+      if (it->type == BatchOp<K, V>::Type::Insert) {
+        if (hit) {
+          (*u)->val = it->val;
+          nodes.push_back(*u++);
+        } else {
+          nodes.push_back(new_node(it->key, it->val));
+        }
+      } else if (hit) {
+        delete_node(*u++);
+      }
+      ++it;
+    }
+
+    count = count - olds.size() + nodes.size();
+    if (path.size() == 1) {
+      root = build(nodes.data(), n, capacity23(n));
+      return;
+    }
+    *path.back() = build(nodes.data(), n, cap);
+    // the links of path live in the nodes above
+    for (std::size_t i = path.size() - 1; i-- > 0;) pull(*path[i]);
+  }
+
+  // in-order traversal of the nodes of the subtree of u
+  template <typename F>
+  void for_each_node(Node* u, F f) {
+    std::stack<Node*> st;
+    while (u || !st.empty()) {
+      while (u) {
+        st.push(u);
+        u = u->left;
+      }
+      u = st.top();
+      st.pop();
+      Node* r = u->right;  // f may relink u
+      f(u);
+      u = r;
+    }
   }
 
  public:
+  ~LLRB() {
+    for_each_node(root, [&](Node* u) { delete_node(u); });
+  }
+
   void insert(const K& key, const V& val) {
+    touch();
     root = insert(root, key, val);
     root->red = false;
     
 #if ENABLE_TEST
-    if(!check_blackheight()) {
+    if(!verify()) {
       std::puts("insert failed");
       exit(0);
     }
@@ -239,11 +469,13 @@ class LLRB : public TreeAbst<K, V> {
   }
 
   void erase(const K& key) {
+    if (!root) return;
+    touch();
     root = erase(root, key);
     if (root) root->red = false;
 
 #if ENABLE_TEST
-    if(!check_blackheight()) {
+    if(!verify()) {
       std::puts("erase failed");
       exit(0);
     }
@@ -265,6 +497,232 @@ class LLRB : public TreeAbst<K, V> {
     return false;
   }
 
+  /**
+   *  apply a batch of inserts and erases as if they were applied in order.
+   *  unlike RBTree this is not a single walk: without parent links a
+   *  descent cannot resume from the previous node, so the sorted batch is
+   *  applied op by op with insert() / erase(), each from the root.
+   *  consecutive ops share the top of their paths, which stays in cache.
+   *  if ops.size() >= rebuild_ratio * (size of the lowest subtree spanning
+   *  the keys of the batch), that subtree is merged with the batch and
+   *  rebuilt in O(its size + ops.size()) instead.
+   */
+  void apply_batch(std::vector<BatchOp<K, V>> ops,
+                   double rebuild_ratio = 0.5) {
+    touch();
+    normalize_batch(ops);
+    if (ops.empty()) return;
+    auto path = batch_span(ops);
+    double limit = ops.size() / rebuild_ratio;
+    std::size_t n =
+        (path.size() == 1 ? count
+                          : subtree_size(*path.back(),
+                                         std::min<double>(limit, count)));
+    if (n <= limit) {
+      rebuild(std::move(path), ops);
+      return;
+    }
+    for (const auto& op : ops) {
+      if (op.type == BatchOp<K, V>::Type::Insert)
+        insert(op.key, op.val);
+      else
+        erase(op.key);
+    }
+  }
+
+  std::size_t size() const { return count; }
+
+  /**
+   *  check all invariants: BST order, root is black, no red right child
+   *  (left lean), no red node has a red child, equal black height and size()
+   */
+  bool verify() {
+    if (isRed(root)) return false;
+
+    std::size_t n = 0;
+    // black height of u, -1 if violated; keys of u must be in (lo, hi)
+    std::function<int(Node*, const K*, const K*)> dfs =
+        [&](Node* u, const K* lo, const K* hi) {
+          if (!u) return 0;
+          ++n;
+          if ((lo && !(*lo < u->key)) || (hi && !(u->key < *hi))) return -1;
+          if (isRed(u->right) || (isRed(u) && isRed(u->left))) return -1;
+          int l = dfs(u->left, lo, &u->key);
+          int r = dfs(u->right, &u->key, hi);
+          if (l < 0 || l != r) return -1;
+          if constexpr (Aug::enabled) {
+            Agg a = u->agg;
+            pull(u);
+            if (!(a == u->agg)) return -1;
+          }
+          return l + !u->red;
+        };
+    return dfs(root, nullptr, nullptr) >= 0 && n == count;
+  }
+
+  /**
+   *  move nodes into a fresh contiguous region in DFS preorder, so that
+   *  a search path is laid out front to back.
+   *  compact_step() visits at most budget nodes and returns true when the
+   *  relayout has finished. the tree may be modified between two steps:
+   *  the walk then resumes after the key it visited last, and while nodes
+   *  carried behind it by rotations are left in the previous region, one
+   *  more lap from the root picks them up.
+   */
+  bool compact_step(std::size_t budget) {
+    if (!next_region) {
+      if (count == 0) {
+        region.reset();
+        return true;
+      }
+      next_region.reset(
+          new NodeRegion<Storage>(storage, sizeof(Node), count));
+      compact_cursor.reset();
+      compact_restart = true;
+    }
+    if (compact_restart) {
+      compact_stack.clear();
+      compact_restart = false;
+      if (!root) {
+        // emptied during the pass, no node is left in either region
+        next_region.reset();
+        region.reset();
+        return true;
+      }
+      compact_resume();
+    }
+
+    for (; budget && !compact_stack.empty(); --budget) {
+      Node** link = compact_stack.back();
+      compact_stack.pop_back();
+      Node* u = *link;
+      if (!next_region->owns(u)) {
+        void* p = next_region->allocate();
+        *link = new (p ? p : storage.allocate(sizeof(Node))) Node(*u);
+        delete_node(u);
+        u = *link;
+      }
+      compact_cursor = u->key;
+      if (u->right) compact_stack.push_back(&u->right);
+      if (u->left) compact_stack.push_back(&u->left);
+    }
+    if (!compact_stack.empty()) return false;
+
+    compact_cursor.reset();
+    if (region && !region->empty()) {
+      compact_restart = true;  // another lap
+      return false;
+    }
+    // every node has left the previous region
+    region = std::move(next_region);
+    return true;
+  }
+
+  void compact() {
+    while (!compact_step(std::size_t(-1))) {
+    }
+  }
+
+  //! fold of Aug over (key, val) with lo <= key <= hi, in O(log n)
+  Agg aggregate(const K& lo, const K& hi) {
+    static_assert(Aug::enabled, "aggregate() needs an augmentation");
+    // the topmost node in [lo, hi] splits the range
+    Node* s = root;
+    while (s && (s->key < lo || hi < s->key))
+      s = (s->key < lo ? s->right : s->left);
+    if (!s) return Aug::identity();
+
+    Agg left = Aug::identity(), right = Aug::identity();
+    for (Node* u = s->left; u;) {
+      if (u->key < lo) {
+        u = u->right;
+      } else {
+        left = Aug::combine(
+            Aug::combine(Aug::lift(u->key, u->val), agg_of(u->right)), left);
+        u = u->left;
+      }
+    }
+    for (Node* u = s->right; u;) {
+      if (hi < u->key) {
+        u = u->left;
+      } else {
+        right = Aug::combine(
+            right, Aug::combine(agg_of(u->left), Aug::lift(u->key, u->val)));
+        u = u->right;
+      }
+    }
+    return Aug::combine(Aug::combine(left, Aug::lift(s->key, s->val)), right);
+  }
+
+  //! visit (key, val) with lo <= key <= hi in ascending order of key
+  template <typename F>
+  void for_each_range(const K& lo, const K& hi, F f) {
+    std::stack<Node*> st;
+    Node* u = root;
+    while (true) {
+      while (u) {
+        if (u->key < lo) {
+          u = u->right;
+        } else {
+          st.push(u);
+          u = u->left;
+        }
+      }
+      if (st.empty()) return;
+      u = st.top();
+      st.pop();
+      if (hi < u->key) return;
+      f(u->key, u->val);
+      u = u->right;
+    }
+  }
+
+  //! interval keys (IntervalAugment): visit every (key, val) whose
+  //! interval intersects [lo, hi], in no particular order
+  template <typename T, typename F>
+  void for_each_overlap(const T& lo, const T& hi, F f) {
+    static_assert(is_interval_augment<Aug>::value,
+                  "for_each_overlap() needs IntervalAugment");
+    std::vector<Node*> st;
+    if (root) st.push_back(root);
+    while (!st.empty()) {
+      Node* u = st.back();
+      st.pop_back();
+      if (u->agg < lo) continue;  // every interval ends before lo
+      if (u->left) st.push_back(u->left);
+      if (hi < u->key.first) continue;  // so does every start on the right
+      if (!(u->key.second < lo)) f(u->key, u->val);
+      if (u->right) st.push_back(u->right);
+    }
+  }
+
+  //! visit all (key, val) in ascending order of key
+  template <typename F>
+  void for_each(F f) {
+    for_each_node(root, [&](Node* u) { f(u->key, u->val); });
+  }
+
+#if __cpp_impl_coroutine
+  //! find as a coroutine that prefetches each node and suspends before
+  //! reading it; run many of them with find_interleaved()
+  //! key and res must outlive the task
+  FindTask find_async(const K& key, V& res) {
+    Node* u = root;
+    while (u) {
+      co_await Prefetch{u};
+      if (key < u->key)
+        u = u->left;
+      else if (key > u->key)
+        u = u->right;
+      else {
+        res = u->val;
+        co_return true;
+      }
+    }
+    co_return false;
+  }
+#endif
+
   std::string dump_dot(std::function<std::string(const K&)> k2s,
                        std::function<std::string(const V&)> v2s) {
     return dump_dot(k2s, v2s, root);
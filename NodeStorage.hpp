@@ -0,0 +1,182 @@
+#pragma once
+
+// node storage backends of RBTree / LLRB
+//   allocate(size) / deallocate(p, size), size is sizeof(Node) of the tree
+//   allocate_region(bytes) / deallocate_region(p, bytes), a contiguous range
+//   for the relayout of compact()
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+//! operator new / delete for each node
+struct HeapStorage {
+  void* allocate(std::size_t size) { return ::operator new(size); }
+  void deallocate(void* p, std::size_t) { ::operator delete(p); }
+  void* allocate_region(std::size_t bytes) { return ::operator new(bytes); }
+  void deallocate_region(void* p, std::size_t) { ::operator delete(p); }
+};
+
+/**
+ *  fixed size blocks carved out of 2 MB huge pages.
+ *  chunks are mapped with MAP_HUGETLB; if no huge page is reserved, falls
+ *  back to 2 MB aligned regular pages advised with MADV_HUGEPAGE (THP).
+ *  NumaNode >= 0 binds the chunks to that NUMA node (best effort).
+ */
+template <int NumaNode = -1>
+class HugePageStorage {
+  static_assert(NumaNode < 64, "NUMA node out of range");
+
+ private:
+  static constexpr std::size_t HUGE_PAGE = std::size_t(2) << 20;
+  static constexpr std::size_t MAX_CHUNK = std::size_t(256) << 20;
+  static constexpr int MPOL_BIND_ = 2;  // <numaif.h>, without libnuma
+
+  struct Free {
+    Free* next;
+  };
+
+  std::vector<std::pair<void*, std::size_t>> chunks;
+  char* cur = nullptr;
+  char* end = nullptr;
+  Free* free_list = nullptr;
+  std::size_t next_chunk = HUGE_PAGE;
+
+  void* map(std::size_t bytes) {
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      ++hugetlb_chunks;
+    } else {
+      // over-allocate to cut out a 2 MB aligned range
+      p = mmap(nullptr, bytes + HUGE_PAGE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) throw std::bad_alloc();
+      auto head = reinterpret_cast<std::uintptr_t>(p);
+      auto aligned = (head + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+      if (aligned != head) munmap(p, aligned - head);
+      munmap(reinterpret_cast<void*>(aligned + bytes),
+             head + HUGE_PAGE - aligned);
+      p = reinterpret_cast<void*>(aligned);
+      madvise(p, bytes, MADV_HUGEPAGE);
+    }
+    if (NumaNode >= 0) {
+      // before the first touch, so that the pages are placed on the node
+      unsigned long mask = 1ul << NumaNode;
+      numa_bound = syscall(SYS_mbind, p, bytes, MPOL_BIND_, &mask,
+                           sizeof(mask) * 8, 0) == 0;
+    }
+    chunks.emplace_back(p, bytes);
+    return p;
+  }
+
+  static std::size_t region_size(std::size_t bytes) {
+    return (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+  }
+
+  static std::size_t block_size(std::size_t size) {
+    constexpr std::size_t a = alignof(std::max_align_t);
+    if (size < sizeof(Free)) size = sizeof(Free);
+    return (size + a - 1) / a * a;
+  }
+
+ public:
+  std::size_t hugetlb_chunks = 0;  // chunks backed by reserved huge pages
+  bool numa_bound = false;
+
+  HugePageStorage() = default;
+  HugePageStorage(const HugePageStorage&) = delete;
+  HugePageStorage& operator=(const HugePageStorage&) = delete;
+  ~HugePageStorage() {
+    for (auto& c : chunks) munmap(c.first, c.second);
+  }
+
+  void* allocate(std::size_t size) {
+    if (free_list) {
+      Free* f = free_list;
+      free_list = f->next;
+      return f;
+    }
+    size = block_size(size);
+    if (size > std::size_t(end - cur)) {  // cur == end == nullptr at first
+      // chunks grow geometrically to keep the number of mappings small
+      cur = static_cast<char*>(map(next_chunk));
+      end = cur + next_chunk;
+      if (next_chunk < MAX_CHUNK) next_chunk *= 2;
+    }
+    void* p = cur;
+    cur += size;
+    return p;
+  }
+
+  void deallocate(void* p, std::size_t) {
+    Free* f = static_cast<Free*>(p);
+    f->next = free_list;
+    free_list = f;
+  }
+
+  //! a chunk of its own, on huge pages and bound like the others
+  void* allocate_region(std::size_t bytes) { return map(region_size(bytes)); }
+
+  void deallocate_region(void* p, std::size_t) {
+    for (auto it = chunks.begin(); it != chunks.end(); ++it) {
+      if (it->first != p) continue;
+      munmap(it->first, it->second);
+      chunks.erase(it);
+      return;
+    }
+  }
+};
+
+/**
+ *  one contiguous range of fixed size blocks, filled in order by compact()
+ *  freed blocks are not reused; they are reclaimed with the whole region,
+ *  which counts its live blocks so that it is known when none is left
+ */
+template <typename Storage>
+class NodeRegion {
+ private:
+  Storage& storage;
+  std::size_t block;
+  std::size_t bytes;
+  char* buf;
+  char* cur;
+  char* end;
+  std::size_t live = 0;
+
+ public:
+  //! n blocks of sizeof(Node), taken from the storage of the tree
+  NodeRegion(Storage& storage, std::size_t size, std::size_t n)
+      : storage(storage), block(size), bytes(size * n) {
+    buf = static_cast<char*>(storage.allocate_region(bytes));
+    cur = buf;
+    end = buf + bytes;
+  }
+  NodeRegion(const NodeRegion&) = delete;
+  NodeRegion& operator=(const NodeRegion&) = delete;
+  ~NodeRegion() { storage.deallocate_region(buf, bytes); }
+
+  //! nullptr if the region is full
+  void* allocate() {
+    if (cur == end) return nullptr;
+    ++live;
+    void* p = cur;
+    cur += block;
+    return p;
+  }
+
+  void deallocate(const void*) { --live; }
+
+  bool empty() const { return live == 0; }
+
+  bool owns(const void* p) const {
+    auto q = static_cast<const char*>(p);
+    return buf <= q && q < end;
+  }
+};
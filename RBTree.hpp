@@ -2,13 +2,27 @@
 
 // ref Introduction to Algorithms, 3rd edition, chapter 13
 
+#include <algorithm>
 #include <functional>
+#include <memory>
+#include <optional>
+#include <stack>
 #include <string>
+#include <utility>
+#include <vector>
+#include "Augment.hpp"
+#include "NodeStorage.hpp"
 #include "Tree.hpp"
+#if __cpp_impl_coroutine
+#include "Interleave.hpp"
+#endif
 
-template <typename K, typename V>
+template <typename K, typename V, typename Storage = HeapStorage,
+          typename Aug = NoAugment>
 class RBTree : public TreeAbst<K, V> {
  private:
+  using Agg = typename Aug::value_type;
+
   enum class OP_BASE {
     Left,
     Right,
@@ -21,6 +35,7 @@ class RBTree : public TreeAbst<K, V> {
     K key;
     V val;
     bool red;
+    [[no_unique_address]] Agg agg;  // fold of Aug over this subtree
     Node* par;
     Node* left;
     Node* right;
@@ -38,16 +53,60 @@ class RBTree : public TreeAbst<K, V> {
   };
 #define GET(l) template get<l>()
 
+  Storage storage;
   Node* nil;
   Node* root;
+  std::size_t count = 0;
+
+  // compact(): nodes laid out in DFS order, and the pass in progress
+  // (regions come from storage, so they are declared after it)
+  std::unique_ptr<NodeRegion<Storage>> region, next_region;
+  std::vector<Node*> compact_stack;
+  std::optional<K> compact_cursor;  // key of the last visited node
+  bool compact_restart = false;
 
   // auxiliary functions
+  template <typename... Args>
+  Node* new_node(Args&&... args) {
+    return new (storage.allocate(sizeof(Node)))
+        Node(std::forward<Args>(args)...);
+  }
+
+  void delete_node(Node* u) {
+    u->~Node();
+    // blocks of regions are reclaimed with the region
+    if (region && region->owns(u)) {
+      region->deallocate(u);
+      return;
+    }
+    if (next_region && next_region->owns(u)) {
+      next_region->deallocate(u);
+      return;
+    }
+    storage.deallocate(u, sizeof(Node));
+  }
+
   bool isRed(const Node* u) {
     return u ? u->red : false;  // all leaves (NIL) is black
   }
 
   bool isBlack(const Node* u) { return !isRed(u); }
 
+  Agg agg_of(const Node* u) { return u == nil ? Aug::identity() : u->agg; }
+
+  // recompute the aggregate of u from its children
+  void pull(Node* u) {
+    if constexpr (Aug::enabled)
+      u->agg = Aug::combine(
+          Aug::combine(agg_of(u->left), Aug::lift(u->key, u->val)),
+          agg_of(u->right));
+  }
+
+  void pull_path(Node* u) {
+    if constexpr (Aug::enabled)
+      for (; u != nil; u = u->par) pull(u);
+  }
+
   std::string dump_dot(std::function<std::string(const K&)> k2s,
                        std::function<std::string(const V&)> v2s, Node* tree) {
     auto n2s = [&](Node* n) {
@@ -94,7 +153,7 @@ class RBTree : public TreeAbst<K, V> {
 
     auto y = x->GET(right);
     x->GET(right) = y->GET(left);
-    if (y->left != nil) {
+    if (y->GET(left) != nil) {
       y->GET(left)->par = x;
     }
     y->par = x->par;
@@ -107,6 +166,8 @@ class RBTree : public TreeAbst<K, V> {
     }
     y->GET(left) = x;
     x->par = y;
+    pull(x);
+    pull(y);
 
     return y;
   }
@@ -156,15 +217,18 @@ class RBTree : public TreeAbst<K, V> {
     root->red = false;
   }
 
-  void insert_(const K& key, const V& val) {
+  // descend from x (root, or an ancestor of the position of key)
+  // return the node holding key
+  Node* insert_(const K& key, const V& val, Node* x) {
     if (root == nil) {
-      root = new Node(key, val, false, nil, nil, nil);
-      return;
+      root = new_node(key, val, false, nil, nil, nil);
+      ++count;
+      pull(root);
+      return root;
     }
 
     // Tree is not nil
     Node* y = nil;
-    Node* x = root;
     while (x != nil) {
       y = x;
       if (key < x->key)
@@ -174,19 +238,25 @@ class RBTree : public TreeAbst<K, V> {
       else
         break;
     }
-    if (x == nil) {  // key is not found
-      x = new Node(key, val, true, nil, nil, nil);
-
-      if (key < y->key)
-        link<OP_BASE::Left>(y, x);
-      else
-        link<OP_BASE::Right>(y, x);
-    } else {  // key already exists
+    if (x != nil) {  // key already exists
       x->val = val;
+      pull_path(x);
+      return x;
     }
 
+    // key is not found
+    x = new_node(key, val, true, nil, nil, nil);
+    ++count;
+
+    if (key < y->key)
+      link<OP_BASE::Left>(y, x);
+    else
+      link<OP_BASE::Right>(y, x);
+    pull_path(x);
+
     insert_fixup(x);
     root->red = false;
+    return x;
   }
 
   // y is possibly nullptr
@@ -206,6 +276,16 @@ class RBTree : public TreeAbst<K, V> {
     return u;
   }
 
+  Node* successor(Node* u) {
+    if (u->right != nil) return get_min(u->right);
+    Node* p = u->par;
+    while (p != nil && u == p->right) {
+      u = p;
+      p = p->par;
+    }
+    return p;
+  }
+
   // precondition: x != nullptr && isBlack(x) && x == x->par->GET(left)
   template <OP_BASE left>
   Node* erase_fixup_loop(Node* x) {
@@ -254,30 +334,29 @@ class RBTree : public TreeAbst<K, V> {
     x->red = false;
   }
 
-  void erase_(const K& key) {
-    if (root == nil) return;
-
-    // Tree is not nil
-    Node* x = root;
-    while (x != nil) {
-      if (key < x->key)
-        x = x->left;
-      else if (key > x->key)
-        x = x->right;
+  Node* search(Node* u, const K& key) {
+    while (u != nil) {
+      if (key < u->key)
+        u = u->left;
+      else if (key > u->key)
+        u = u->right;
       else
         break;
     }
-    if (x == nil) {  // key is not found
-      return;
-    }
+    return u;
+  }
+
+  void erase_(Node* x) {
+    --count;
     if (x == root && x->left == nil && x->right == nil) {  // single node
-      delete x;
+      delete_node(x);
       root = nil;
       return;
     }
 
     Node* will_remove = x;
     Node* y = x;
+    Node* changed = x->par;  // the lowest node whose subtree changes
     auto original_y_red = y->red;
     if (x->left == nil) {
       transplant(x, x->right);
@@ -290,6 +369,7 @@ class RBTree : public TreeAbst<K, V> {
       y = get_min(z->right);
       original_y_red = y->red;
       x = y->right;
+      changed = (y->par == z ? y : y->par);
 
       if (y->par == z) {
         x->par = y;
@@ -301,10 +381,11 @@ class RBTree : public TreeAbst<K, V> {
       link<OP_BASE::Left>(y, z->left);
       y->red = z->red;
     }
+    pull_path(changed);
 
     if (will_remove != nil) {
       will_remove->left = will_remove->right = nullptr;
-      delete will_remove;
+      delete_node(will_remove);
     }
 
     if (!original_y_red) {  // y is black
@@ -312,27 +393,252 @@ class RBTree : public TreeAbst<K, V> {
     }
   }
 
-  bool check_blackheight() {
-    int c = 0;
-    auto u = root;
-    while (u != nil) {
-      if (!u->red) ++c;
-      u = u->left;
+  void erase_(const K& key) {
+    if (root == nil) return;
+
+    // Tree is not nil
+    Node* x = search(root, key);
+    if (x == nil) {  // key is not found
+      return;
     }
+    erase_(x);
+  }
+
+  /**
+   *  batch application
+   */
+
+  // climb from finger u until key lies in the subtree of u
+  // precondition: the predecessor of u is less than key
+  Node* climb(Node* u, const K& key) {
+    while (u->par != nil && !(u == u->par->left && key < u->par->key))
+      u = u->par;
+    return u;
+  }
 
-    std::function<bool(Node*, int)> dfs = [&](Node* u, int c) {
-      if (u == nil) return c == 0;
-      if (!u->red) --c;
-      return dfs(u->left, c) && dfs(u->right, c);
+  // ops is sorted and has distinct keys
+  void apply_sorted(const std::vector<BatchOp<K, V>>& ops) {
+    // invariant: finger == nil || the predecessor of finger < next key
+    Node* finger = nil;
+    for (const auto& op : ops) {
+      Node* from = (finger == nil ? root : climb(finger, op.key));
+      if (op.type == BatchOp<K, V>::Type::Insert) {
+        finger = insert_(op.key, op.val, from);
+      } else {
+        Node* x = search(from, op.key);
+        if (x == nil) continue;
+        finger = successor(x);  // the successor is not freed by erase_
+        erase_(x);
+      }
+    }
+  }
+
+  // relink a[0..n) into a 2-3 shaped tree of capacity cap (= 3^h - 1)
+  // (3-node: black node with red left child)
+  // precondition: 2^h - 1 <= n <= cap
+  Node* build(Node** a, std::size_t n, std::size_t cap) {
+    if (n == 0) return nil;
+    auto adopt = [&](Node* u) {
+      if (u->left != nil) u->left->par = u;
+      if (u->right != nil) u->right->par = u;
     };
+    std::size_t c = (cap - 2) / 3;
+
+    if (n - 1 <= 2 * c) {  // 2-node
+      std::size_t l = (n - 1) / 2;
+      Node* u = a[l];
+      u->red = false;
+      u->left = build(a, l, c);
+      u->right = build(a + l + 1, n - 1 - l, c);
+      adopt(u);
+      pull(u);
+      return u;
+    }
+
+    // 3-node
+    std::size_t m = n - 2, p = m / 3, q = (m - p) / 2;
+    Node* v = a[p];
+    v->red = true;
+    v->left = build(a, p, c);
+    v->right = build(a + p + 1, q, c);
+    adopt(v);
+    pull(v);
+
+    Node* u = a[p + 1 + q];
+    u->red = false;
+    u->left = v;
+    u->right = build(a + p + q + 2, m - p - q, c);
+    adopt(u);
+    pull(u);
+    return u;
+  }
+
+  // the lowest black node whose subtree spans the keys of ops
+  // (nil if the tree is empty); precondition: ops is sorted and not empty
+  Node* batch_span(const std::vector<BatchOp<K, V>>& ops) {
+    const K& lo = ops.front().key;
+    const K& hi = ops.back().key;
+    Node* s = root;
+    while (s != nil) {
+      if (hi < s->key && s->left != nil)
+        s = s->left;
+      else if (s->key < lo && s->right != nil)
+        s = s->right;
+      else
+        break;
+    }
+    while (s->red) s = s->par;
+    return s;
+  }
 
-    return dfs(root, c);
+  // size of the subtree of u, counted up to limit + 1
+  std::size_t subtree_size(Node* u, std::size_t limit) {
+    std::size_t n = 0;
+    std::vector<Node*> st;
+    if (u != nil) st.push_back(u);
+    while (!st.empty() && n <= limit) {
+      u = st.back();
+      st.pop_back();
+      ++n;
+      if (u->left != nil) st.push_back(u->left);
+      if (u->right != nil) st.push_back(u->right);
+    }
+    return n;
   }
+
+  // merge ops into the nodes of the subtree of s and build it again.
+  // the subtree keeps its black height, so climbs to a larger one while
+  // the merged size does not fit it (up to the whole tree)
+  // precondition: s is black and spans the keys of ops
+  void rebuild(Node* s, const std::vector<BatchOp<K, V>>& ops) {
+    std::vector<Node*> olds;
+    std::size_t n, cap = 0;
+    while (true) {
+      olds.clear();
+      std::stack<Node*> st;
+      for (Node* u = s; u != nil || !st.empty(); u = u->right) {
+        for (; u != nil; u = u->left) st.push(u);
+        u = st.top();
+        st.pop();
+        olds.push_back(u);
+      }
+
+      n = olds.size();
+      auto u = olds.begin();
+      for (const auto& op : ops) {
+        while (u != olds.end() && (*u)->key < op.key) ++u;
+        bool hit = (u != olds.end() && !(op.key < (*u)->key));
+        if (op.type == BatchOp<K, V>::Type::Insert)
+          n += !hit;
+        else
+          n -= hit;
+      }
+      if (s == root) break;
+
+      // a 2-3 shaped tree of black height h holds 2^h - 1 to 3^h - 1 nodes
+      std::size_t lo = 1;
+      cap = 2;
+      for (Node* u = s->left; u != nil; u = u->left) {
+        if (u->red) continue;
+        lo = lo * 2 + 1;
+        cap = cap * 3 + 2;
+      }
+      if (lo <= n && n <= cap) break;
+      for (s = s->par; s->red; s = s->par) {
+      }
+    }
+
+    // s itself may be erased by the merge
+    const bool whole = (s == root);
+    Node* p = (whole ? nil : s->par);
+    const bool left = (!whole && s == p->left);
+
+    std::vector<Node*> nodes;
+    nodes.reserve(n);
+    auto u = olds.begin();
+    auto it = ops.begin();
+    while (u != olds.end() || it != ops.end()) {
+      if (it == ops.end() || (u != olds.end() && (*u)->key < it->key)) {
+        nodes.push_back(*u++);
+        continue;
+      }
+      bool hit = (u != olds.end() && !(it->key < (*u)->key));
+      if (it->type == BatchOp<K, V>::Type::Insert) {
+        if (hit) {
+          (*u)->val = it->val;
+          nodes.push_back(*u++);
+        } else {
+          nodes.push_back(new_node(it->key, it->val, true, nil, nil, nil));
+        }
+      } else if (hit) {
+        delete_node(*u++);
+      }
+      ++it;
+    }
+
+    count = count - olds.size() + nodes.size();
+    if (whole) {
+      root = build(nodes.data(), n, capacity23(n));
+      root->par = nil;
+      return;
+    }
+    Node* t = build(nodes.data(), n, cap);
+    t->par = p;
+    (left ? p->left : p->right) = t;
+    pull_path(p);
+  }
+
+  /**
+   *  relayout
+   */
+
+  // a mutation between two compact_step() invalidates compact_stack
+  void touch() {
+    if (next_region) compact_restart = true;
+  }
+
+  // rebuild compact_stack as the preorder walk stands after compact_cursor
+  void compact_resume() {
+    if (!compact_cursor) {
+      compact_stack.push_back(root);
+      return;
+    }
+    const K& k = *compact_cursor;
+    for (Node* u = root; u != nil;) {
+      if (k < u->key) {
+        if (u->right != nil) compact_stack.push_back(u->right);
+        u = u->left;
+      } else if (u->key < k) {
+        u = u->right;
+      } else {
+        if (u->right != nil) compact_stack.push_back(u->right);
+        if (u->left != nil) compact_stack.push_back(u->left);
+        return;
+      }
+    }
+  }
+
+  // move u to next_region (to storage if it is full)
+  Node* relocate(Node* u) {
+    void* p = next_region->allocate();
+    Node* v = new (p ? p : storage.allocate(sizeof(Node))) Node(*u);
+    if (u->par == nil)
+      root = v;
+    else if (u == u->par->left)
+      u->par->left = v;
+    else
+      u->par->right = v;
+    if (v->left != nil) v->left->par = v;
+    if (v->right != nil) v->right->par = v;
+    delete_node(u);
+    return v;
+  }
+
 #undef GET
 
  public:
   RBTree() {
-    nil = new Node();
+    nil = new_node();
     nil->left = nil->right = nil->par = nil;
     root = nil;
   }
@@ -345,16 +651,17 @@ class RBTree : public TreeAbst<K, V> {
 
       if (u->left != nil) st.push(u->left);
       if (u->right != nil) st.push(u->right);
-      delete u;
+      delete_node(u);
     }
-    delete nil;
+    delete_node(nil);
   }
 
   void insert(const K& key, const V& val) {
-    insert_(key, val);
+    touch();
+    insert_(key, val, root);
 
 #if ENABLE_TEST
-    if (!check_blackheight()) {
+    if (!verify()) {
       std::puts("insert failed");
       std::cerr << dump_dot([](const K& k) { return std::to_string((int)k); },
                             [](const V& k) { return std::to_string((int)k); },
@@ -366,10 +673,11 @@ class RBTree : public TreeAbst<K, V> {
   }
 
   void erase(const K& key) {
+    touch();
     erase_(key);
 
 #if ENABLE_TEST
-    if (!check_blackheight()) {
+    if (!verify()) {
       std::puts("erase failed");
       std::cerr << dump_dot([](const K& k) { return std::to_string((int)k); },
                             [](const V& k) { return std::to_string((int)k); },
@@ -395,6 +703,221 @@ class RBTree : public TreeAbst<K, V> {
     return false;
   }
 
+  /**
+   *  apply a batch of inserts and erases as if they were applied in order.
+   *  the batch is sorted, then applied in a single left-to-right walk that
+   *  resumes every descent from the previously touched node.
+   *  if ops.size() >= rebuild_ratio * (size of the lowest subtree spanning
+   *  the keys of the batch), that subtree is merged with the batch and
+   *  rebuilt in O(its size + ops.size()) instead.
+   */
+  void apply_batch(std::vector<BatchOp<K, V>> ops,
+                   double rebuild_ratio = 1.0) {
+    touch();
+    normalize_batch(ops);
+    if (ops.empty()) return;
+    Node* s = batch_span(ops);
+    double limit = ops.size() / rebuild_ratio;
+    std::size_t n =
+        (s == root ? count
+                   : subtree_size(s, std::min<double>(limit, count)));
+    if (n <= limit)
+      rebuild(s, ops);
+    else
+      apply_sorted(ops);
+  }
+
+  std::size_t size() const { return count; }
+
+  /**
+   *  check all invariants: BST order, root is black, no red node has a red
+   *  child, equal black height, consistent parent links and size()
+   */
+  bool verify() {
+    if (nil->red) return false;
+    if (root == nil) return count == 0;
+    if (root->red || root->par != nil) return false;
+
+    std::size_t n = 0;
+    // black height of u, -1 if violated; keys of u must be in (lo, hi)
+    std::function<int(Node*, const K*, const K*)> dfs =
+        [&](Node* u, const K* lo, const K* hi) {
+          if (u == nil) return 0;
+          ++n;
+          if ((lo && !(*lo < u->key)) || (hi && !(u->key < *hi))) return -1;
+          for (Node* c : {u->left, u->right})
+            if (c != nil && (c->par != u || (u->red && c->red))) return -1;
+          int l = dfs(u->left, lo, &u->key);
+          int r = dfs(u->right, &u->key, hi);
+          if (l < 0 || l != r) return -1;
+          if constexpr (Aug::enabled) {
+            Agg a = u->agg;
+            pull(u);
+            if (!(a == u->agg)) return -1;
+          }
+          return l + !u->red;
+        };
+    return dfs(root, nullptr, nullptr) >= 0 && n == count;
+  }
+
+  /**
+   *  move nodes into a fresh contiguous region in DFS preorder, so that
+   *  a search path is laid out front to back.
+   *  compact_step() visits at most budget nodes and returns true when the
+   *  relayout has finished. the tree may be modified between two steps:
+   *  the walk then resumes after the key it visited last, and while nodes
+   *  carried behind it by rotations are left in the previous region, one
+   *  more lap from the root picks them up.
+   */
+  bool compact_step(std::size_t budget) {
+    if (!next_region) {
+      if (count == 0) {
+        region.reset();
+        return true;
+      }
+      next_region.reset(
+          new NodeRegion<Storage>(storage, sizeof(Node), count));
+      compact_cursor.reset();
+      compact_restart = true;
+    }
+    if (compact_restart) {
+      compact_stack.clear();
+      compact_restart = false;
+      if (root == nil) {
+        // emptied during the pass, no node is left in either region
+        next_region.reset();
+        region.reset();
+        return true;
+      }
+      compact_resume();
+    }
+
+    for (; budget && !compact_stack.empty(); --budget) {
+      Node* u = compact_stack.back();
+      compact_stack.pop_back();
+      if (!next_region->owns(u)) u = relocate(u);
+      compact_cursor = u->key;
+      if (u->right != nil) compact_stack.push_back(u->right);
+      if (u->left != nil) compact_stack.push_back(u->left);
+    }
+    if (!compact_stack.empty()) return false;
+
+    compact_cursor.reset();
+    if (region && !region->empty()) {
+      compact_restart = true;  // another lap
+      return false;
+    }
+    // every node has left the previous region
+    region = std::move(next_region);
+    return true;
+  }
+
+  void compact() {
+    while (!compact_step(std::size_t(-1))) {
+    }
+  }
+
+  //! fold of Aug over (key, val) with lo <= key <= hi, in O(log n)
+  Agg aggregate(const K& lo, const K& hi) {
+    static_assert(Aug::enabled, "aggregate() needs an augmentation");
+    // the topmost node in [lo, hi] splits the range
+    Node* s = root;
+    while (s != nil && (s->key < lo || hi < s->key))
+      s = (s->key < lo ? s->right : s->left);
+    if (s == nil) return Aug::identity();
+
+    Agg left = Aug::identity(), right = Aug::identity();
+    for (Node* u = s->left; u != nil;) {
+      if (u->key < lo) {
+        u = u->right;
+      } else {
+        left = Aug::combine(
+            Aug::combine(Aug::lift(u->key, u->val), agg_of(u->right)), left);
+        u = u->left;
+      }
+    }
+    for (Node* u = s->right; u != nil;) {
+      if (hi < u->key) {
+        u = u->left;
+      } else {
+        right = Aug::combine(
+            right, Aug::combine(agg_of(u->left), Aug::lift(u->key, u->val)));
+        u = u->right;
+      }
+    }
+    return Aug::combine(Aug::combine(left, Aug::lift(s->key, s->val)), right);
+  }
+
+  //! visit (key, val) with lo <= key <= hi in ascending order of key
+  template <typename F>
+  void for_each_range(const K& lo, const K& hi, F f) {
+    std::stack<Node*> st;
+    Node* u = root;
+    while (true) {
+      while (u != nil) {
+        if (u->key < lo) {
+          u = u->right;
+        } else {
+          st.push(u);
+          u = u->left;
+        }
+      }
+      if (st.empty()) return;
+      u = st.top();
+      st.pop();
+      if (hi < u->key) return;
+      f(u->key, u->val);
+      u = u->right;
+    }
+  }
+
+  //! interval keys (IntervalTree): visit every (key, val) whose interval
+  //! intersects [lo, hi], in no particular order
+  template <typename T, typename F>
+  void for_each_overlap(const T& lo, const T& hi, F f) {
+    static_assert(is_interval_augment<Aug>::value,
+                  "for_each_overlap() needs IntervalAugment");
+    std::vector<Node*> st;
+    if (root != nil) st.push_back(root);
+    while (!st.empty()) {
+      Node* u = st.back();
+      st.pop_back();
+      if (u->agg < lo) continue;  // every interval ends before lo
+      if (u->left != nil) st.push_back(u->left);
+      if (hi < u->key.first) continue;  // so does every start on the right
+      if (!(u->key.second < lo)) f(u->key, u->val);
+      if (u->right != nil) st.push_back(u->right);
+    }
+  }
+
+  //! visit all (key, val) in ascending order of key
+  template <typename F>
+  void for_each(F f) {
+    if (root == nil) return;
+    for (Node* u = get_min(root); u != nil; u = successor(u)) f(u->key, u->val);
+  }
+
+#if __cpp_impl_coroutine
+  //! find as a coroutine that prefetches each node and suspends before
+  //! reading it; run many of them with find_interleaved()
+  //! key and res must outlive the task
+  FindTask find_async(const K& key, V& res) {
+    Node* u = root;
+    while (u != nil) {
+      co_await Prefetch{u};
+      if (key < u->key)
+        u = u->left;
+      else if (key > u->key)
+        u = u->right;
+      else {
+        res = u->val;
+        co_return true;
+      }
+    }
+    co_return false;
+  }
+#endif
+
   std::string dump_dot(std::function<std::string(const K&)> k2s,
                        std::function<std::string(const V&)> v2s) {
     return dump_dot(k2s, v2s, root);
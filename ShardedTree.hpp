@@ -0,0 +1,82 @@
+#pragma once
+
+// partitions keys over independent trees, each guarded by its own lock
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Tree.hpp"
+
+template <template <typename...> class T, typename K, typename V>
+class ShardedTree : public TreeAbst<K, V> {
+ private:
+  static constexpr std::size_t CACHE_LINE = 64;
+
+  // one shard never shares a cache line with its neighbours
+  struct alignas(CACHE_LINE) Shard {
+    std::mutex mtx;
+    T<K, V> tree;
+  };
+
+  std::size_t n;
+  std::unique_ptr<Shard[]> shards;
+  std::vector<K> bounds;  // empty: hash partitioning
+
+  std::size_t shard_of(const K& key) const {
+    if (!bounds.empty())
+      return std::upper_bound(bounds.begin(), bounds.end(), key) -
+             bounds.begin();
+    return mix_hash(key) % n;
+  }
+
+ public:
+  //! hash partitioning over `shard_num` trees
+  explicit ShardedTree(std::size_t shard_num = 1)
+      : n(std::max<std::size_t>(shard_num, 1)), shards(new Shard[n]) {}
+
+  //! range partitioning: shard i holds keys in [bounds[i-1], bounds[i])
+  explicit ShardedTree(std::vector<K> bounds_)
+      : n(bounds_.size() + 1), shards(new Shard[n]), bounds(std::move(bounds_)) {
+    std::sort(bounds.begin(), bounds.end());
+  }
+
+  //! pick `shard_num - 1` bounds from quantiles of `sample`
+  static std::vector<K> quantiles(std::vector<K> sample, std::size_t shard_num) {
+    std::vector<K> res;
+    if (sample.empty()) return res;
+    std::sort(sample.begin(), sample.end());
+    for (std::size_t i = 1; i < shard_num; ++i)
+      res.push_back(sample[sample.size() * i / shard_num]);
+    return res;
+  }
+
+  std::size_t shard_num() const { return n; }
+
+  void insert(const K& key, const V& val) {
+    auto& s = shards[shard_of(key)];
+    std::lock_guard<std::mutex> lock(s.mtx);
+    s.tree.insert(key, val);
+  }
+
+  void erase(const K& key) {
+    auto& s = shards[shard_of(key)];
+    std::lock_guard<std::mutex> lock(s.mtx);
+    s.tree.erase(key);
+  }
+
+  bool find(const K& key, V& res) {
+    auto& s = shards[shard_of(key)];
+    std::lock_guard<std::mutex> lock(s.mtx);
+    return s.tree.find(key, res);
+  }
+
+  //! visit all (key, val); ascending order of key only if range partitioned
+  template <typename F>
+  void for_each(F f) {
+    for (std::size_t i = 0; i < n; ++i) {
+      std::lock_guard<std::mutex> lock(shards[i].mtx);
+      shards[i].tree.for_each(f);
+    }
+  }
+};
@@ -1,8 +1,57 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
 template <typename K, typename V>
 struct TreeAbst {
   virtual void insert(const K& key, const V& val) = 0;
   virtual void erase(const K& key) = 0;
   virtual bool find(const K& key, V& res) = 0;
 };
+
+//! std::hash mixed by fibonacci hashing (std::hash of integers is identity)
+template <typename K>
+std::size_t mix_hash(const K& key) {
+  std::uint64_t h = std::hash<K>()(key) * 0x9E3779B97F4A7C15ull;
+  return h >> 32;
+}
+
+//! a single mutation of apply_batch()
+template <typename K, typename V>
+struct BatchOp {
+  enum class Type {
+    Insert,
+    Erase,
+  };
+  Type type;
+  K key;
+  V val;
+};
+
+//! sort ops by key, keeping only the last op for each key
+template <typename K, typename V>
+void normalize_batch(std::vector<BatchOp<K, V>>& ops) {
+  std::stable_sort(ops.begin(), ops.end(),
+                   [](const BatchOp<K, V>& a, const BatchOp<K, V>& b) {
+                     return a.key < b.key;
+                   });
+  std::size_t w = 0;
+  for (std::size_t i = 0; i < ops.size(); ++i) {
+    if (i + 1 < ops.size() && !(ops[i].key < ops[i + 1].key)) continue;
+    if (w != i) ops[w] = std::move(ops[i]);
+    ++w;
+  }
+  ops.resize(w);
+}
+
+//! the number of keys (3^h - 1) of a full 2-3 tree whose height h is
+//! minimum to hold n keys
+inline std::size_t capacity23(std::size_t n) {
+  std::size_t cap = 0;
+  while (cap < n) cap = cap * 3 + 2;
+  return cap;
+}
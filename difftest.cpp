@@ -0,0 +1,42 @@
+// randomized differential tester
+//   usage: difftest [iterations = 200] [ops bytes = 16384] [seed = 123]
+// a failing input is saved to difftest-<seed>-<iteration>.bin, which the
+// fuzz target replays
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include "difftest.hpp"
+
+int main(int argc, char** argv) {
+  int iterations = argc > 1 ? std::atoi(argv[1]) : 200;
+  std::size_t length = argc > 2 ? std::atoi(argv[2]) : 16384;
+  unsigned seed = argc > 3 ? std::atoi(argv[3]) : 123;
+
+  if (!difftest::regressions()) {
+    std::printf("failed in the fixed scenarios\n");
+    return 1;
+  }
+
+  std::mt19937 mt(seed);
+  std::vector<std::uint8_t> data(length);
+  for (int i = 0; i < iterations; ++i) {
+    for (auto& b : data) b = mt();
+    // short inputs keep the trees small, where rebalancing cases are dense
+    std::size_t size = i % 2 ? length : mt() % length;
+    if (!difftest::run_all(data.data(), size)) {
+      std::string path =
+          "difftest-" + std::to_string(seed) + "-" + std::to_string(i) + ".bin";
+      if (FILE* fp = std::fopen(path.c_str(), "wb")) {
+        std::fwrite(data.data(), 1, size, fp);
+        std::fclose(fp);
+      }
+      std::printf("failed at iteration %d, input saved to %s\n", i,
+                  path.c_str());
+      return 1;
+    }
+  }
+  std::printf("passed %d iterations\n", iterations);
+  return 0;
+}
@@ -0,0 +1,460 @@
+#pragma once
+
+// differential testing against Stdmap, driven by a byte string
+// shared by the randomized tester (difftest.cpp) and the fuzzer (fuzz.cpp)
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "CachedTree.hpp"
+#include "IntervalTree.hpp"
+#include "LLRB.hpp"
+#include "RBTree.hpp"
+#include "ShardedTree.hpp"
+#include "stdmap.hpp"
+
+namespace difftest {
+
+using K = int;
+using V = int;
+using Op = BatchOp<K, V>;
+using Sum = SumAugment<K, V, long long>;
+
+/**
+ *  hooks for the operations beyond TreeAbst
+ */
+
+template <typename Tree>
+bool verify(Tree&) {
+  return true;
+}
+template <typename S, typename A>
+bool verify(RBTree<K, V, S, A>& tree) {
+  return tree.verify();
+}
+template <typename S, typename A>
+bool verify(LLRB<K, V, S, A>& tree) {
+  return tree.verify();
+}
+
+template <typename Tree>
+void apply_batch(Tree& tree, const std::vector<Op>& ops, double) {
+  for (const auto& op : ops) {
+    if (op.type == Op::Type::Insert)
+      tree.insert(op.key, op.val);
+    else
+      tree.erase(op.key);
+  }
+}
+template <typename S, typename A>
+void apply_batch(RBTree<K, V, S, A>& tree, const std::vector<Op>& ops,
+                 double ratio) {
+  tree.apply_batch(ops, ratio);
+}
+template <typename S, typename A>
+void apply_batch(LLRB<K, V, S, A>& tree, const std::vector<Op>& ops,
+                 double ratio) {
+  tree.apply_batch(ops, ratio);
+}
+
+template <typename Tree>
+void compact_step(Tree&, std::size_t) {}
+template <typename S, typename A>
+void compact_step(RBTree<K, V, S, A>& tree, std::size_t budget) {
+  tree.compact_step(budget);
+}
+template <typename S, typename A>
+void compact_step(LLRB<K, V, S, A>& tree, std::size_t budget) {
+  tree.compact_step(budget);
+}
+
+// find_interleaved() over the same key twice, so that two lookups are in
+// flight; falls back to find() for trees without find_async(), and where
+// coroutines are not supported
+template <typename Tree>
+bool find_async(Tree& tree, K key, V& res) {
+  return tree.find(key, res);
+}
+#if __cpp_impl_coroutine
+template <typename Tree>
+bool find_async_(Tree& tree, K key, V& res) {
+  K keys[2] = {key, key};
+  V vals[2] = {-1, -1};
+  bool found[2];
+  std::size_t hits = find_interleaved(tree, keys, 2, vals, found, 2);
+  res = vals[0];
+  return hits == 2 && vals[0] == vals[1];
+}
+template <typename S, typename A>
+bool find_async(RBTree<K, V, S, A>& tree, K key, V& res) {
+  return find_async_(tree, key, res);
+}
+template <typename S, typename A>
+bool find_async(LLRB<K, V, S, A>& tree, K key, V& res) {
+  return find_async_(tree, key, res);
+}
+#endif
+
+// for_each_range() against Stdmap, and aggregate() against the range sum
+template <typename Tree>
+bool check_range_(Tree& tree, Stdmap<K, V>& ref, K lo, K hi,
+                  long long& sum) {
+  std::vector<std::pair<K, V>> got, expect;
+  tree.for_each_range(lo, hi,
+                      [&](const K& k, const V& v) { got.emplace_back(k, v); });
+  sum = 0;
+  ref.for_each([&](const K& k, const V& v) {
+    if (k < lo || hi < k) return;
+    expect.emplace_back(k, v);
+    sum += v;
+  });
+  return got == expect;
+}
+
+template <typename Tree>
+bool check_range(Tree&, Stdmap<K, V>&, K, K) {
+  return true;
+}
+template <typename S, typename A>
+bool check_range(RBTree<K, V, S, A>& tree, Stdmap<K, V>& ref, K lo, K hi) {
+  long long sum;
+  return check_range_(tree, ref, lo, hi, sum);
+}
+template <typename S, typename A>
+bool check_range(LLRB<K, V, S, A>& tree, Stdmap<K, V>& ref, K lo, K hi) {
+  long long sum;
+  return check_range_(tree, ref, lo, hi, sum);
+}
+template <typename S>
+bool check_range(RBTree<K, V, S, Sum>& tree, Stdmap<K, V>& ref, K lo, K hi) {
+  long long sum;
+  return check_range_(tree, ref, lo, hi, sum) && tree.aggregate(lo, hi) == sum;
+}
+template <typename S>
+bool check_range(LLRB<K, V, S, Sum>& tree, Stdmap<K, V>& ref, K lo, K hi) {
+  long long sum;
+  return check_range_(tree, ref, lo, hi, sum) && tree.aggregate(lo, hi) == sum;
+}
+
+template <typename Tree>
+std::vector<std::pair<K, V>> dump(Tree& tree) {
+  std::vector<std::pair<K, V>> res;
+  tree.for_each([&](const K& k, const V& v) { res.emplace_back(k, v); });
+  return res;
+}
+
+//! range partitioned, so that for_each is ordered
+struct ShardedLLRB : ShardedTree<LLRB, K, V> {
+  ShardedLLRB() : ShardedTree<LLRB, K, V>(std::vector<K>{64, 1024, 4096}) {}
+};
+
+//! hash partitioned (the default); for_each visits the shards in turn
+struct ShardedHashLLRB : ShardedTree<LLRB, K, V> {
+  ShardedHashLLRB() : ShardedTree<LLRB, K, V>(4) {}
+};
+
+inline std::vector<std::pair<K, V>> dump(ShardedHashLLRB& tree) {
+  std::vector<std::pair<K, V>> res;
+  tree.for_each([&](const K& k, const V& v) { res.emplace_back(k, v); });
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+class Input {
+ private:
+  const std::uint8_t* p;
+  std::size_t n;
+
+ public:
+  Input(const std::uint8_t* data, std::size_t size) : p(data), n(size) {}
+  bool empty() const { return n == 0; }
+  int byte() {
+    if (n == 0) return 0;
+    --n;
+    return *p++;
+  }
+};
+
+/**
+ *  replay data as operations on Tree and on Stdmap, and compare every
+ *  result; returns false (with a message on stderr) on the first mismatch
+ */
+template <typename Tree>
+bool run(const std::uint8_t* data, std::size_t size, const char* name) {
+  Input in(data, size);
+  // a narrow key space makes duplicates and misses frequent
+  const int key_range = 1 << (4 + in.byte() % 12);
+  auto key = [&]() {
+    int hi = in.byte();
+    int lo = in.byte();
+    return (hi << 8 | lo) % key_range;
+  };
+
+  Tree tree;
+  Stdmap<K, V> ref;
+  V next_val = 0;
+  std::size_t step = 0;
+  auto fail = [&](const char* what) {
+    std::fprintf(stderr, "%s: %s mismatch at op %zu\n", name, what, step);
+    return false;
+  };
+
+  while (!in.empty()) {
+    ++step;
+    switch (in.byte() % 9) {
+      case 0:
+      case 1: {
+        K k = key();
+        tree.insert(k, next_val);
+        ref.insert(k, next_val);
+        ++next_val;
+        break;
+      }
+      case 2:
+      case 3: {
+        K k = key();
+        tree.erase(k);
+        ref.erase(k);
+        break;
+      }
+      case 4: {
+        K k = key();
+        V v1 = -1, v2 = -1;
+        bool f1 = tree.find(k, v1), f2 = ref.find(k, v2);
+        if (f1 != f2 || (f1 && v1 != v2)) return fail("find");
+        V v3 = -1;
+        bool f3 = find_async(tree, k, v3);
+        if (f3 != f2 || (f3 && v3 != v2)) return fail("find_async");
+        break;
+      }
+      case 5: {
+        std::vector<Op> ops(in.byte() % 64);
+        // clustered keys make the batch span a subtree below the root
+        int width = (in.byte() % 2 ? 16 : key_range);
+        K base = key();
+        for (auto& op : ops) {
+          bool ins = in.byte() % 2;
+          K k = (width < key_range ? base + key() % width : key());
+          op = Op{ins ? Op::Type::Insert : Op::Type::Erase, k, next_val++};
+        }
+        // always rebuild / never rebuild / default
+        const double ratios[] = {0., std::numeric_limits<double>::infinity(),
+                                 0.5};
+        apply_batch(tree, ops, ratios[in.byte() % 3]);
+        apply_batch(ref, ops, 0.);
+        break;
+      }
+      case 6: {
+        // small budgets leave the pass unfinished across other operations
+        int b = in.byte();
+        compact_step(tree, b % 2 ? b / 2 % 4 : b);
+        break;
+      }
+      case 7: {
+        if (!verify(tree)) return fail("invariant");
+        if (dump(tree) != dump(ref)) return fail("content");
+        K lo = key(), hi = key();
+        if (!check_range(tree, ref, lo, hi)) return fail("range");
+        break;
+      }
+      case 8: {
+        // erase everything, in ascending or descending key order
+        auto items = dump(ref);
+        if (in.byte() % 2) std::reverse(items.begin(), items.end());
+        for (const auto& item : items) {
+          tree.erase(item.first);
+          ref.erase(item.first);
+        }
+        break;
+      }
+    }
+  }
+  if (!verify(tree)) return fail("invariant");
+  if (dump(tree) != dump(ref)) return fail("content");
+  return true;
+}
+
+/**
+ *  fixed scenarios of past bugs
+ */
+
+// the tree is emptied while a compaction pass is unfinished
+template <typename Tree>
+bool compact_drained(const char* name) {
+  Tree tree;
+  for (int round = 0; round < 2; ++round) {
+    for (K k = 0; k < 100; ++k) tree.insert(k, k);
+    tree.compact_step(10);
+    for (K k = 0; k < 100; ++k) tree.erase(k);
+    if (!tree.compact_step(1000) || !tree.verify() || !dump(tree).empty()) {
+      std::fprintf(stderr, "%s: compaction of a drained tree failed\n", name);
+      return false;
+    }
+  }
+  return true;
+}
+
+// one write between every two slices of a pass; the pass must still end
+template <typename Tree>
+bool compact_live(const char* name) {
+  constexpr K N = 20000;
+  constexpr std::size_t BUDGET = 256, MAX_SLICES = 8 * N / BUDGET;
+  Tree tree;
+  Stdmap<K, V> ref;
+  for (K i = 0; i < N; ++i) {
+    tree.insert(i * 7919 % N, i);  // 7919 is coprime to N
+    ref.insert(i * 7919 % N, i);
+  }
+  K next = N;
+  // the first pass moves nodes off the heap, the second off a region
+  for (int round = 0; round < 2; ++round) {
+    std::size_t slices = 0;
+    while (!tree.compact_step(BUDGET)) {
+      if (++slices > MAX_SLICES) {
+        std::fprintf(stderr, "%s: compaction under writes did not end\n",
+                     name);
+        return false;
+      }
+      if (slices % 2) {
+        tree.insert(next, next);
+        ref.insert(next, next);
+        ++next;
+      } else {
+        K k = K(slices * 7919 % N);
+        tree.erase(k);
+        ref.erase(k);
+      }
+    }
+    if (!tree.verify() || dump(tree) != dump(ref)) {
+      std::fprintf(stderr, "%s: compaction under writes broke the tree\n",
+                   name);
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool regressions() {
+  return compact_drained<LLRB<K, V>>("LLRB") &&
+         compact_drained<RBTree<K, V>>("RBTree") &&
+         compact_drained<LLRB<K, V, HugePageStorage<>>>("LLRB (huge pages)") &&
+         compact_drained<RBTree<K, V, HugePageStorage<>>>(
+             "RBTree (huge pages)") &&
+         compact_live<LLRB<K, V>>("LLRB") &&
+         compact_live<RBTree<K, V>>("RBTree") &&
+         compact_live<LLRB<K, V, HugePageStorage<>>>("LLRB (huge pages)") &&
+         compact_live<RBTree<K, V, HugePageStorage<>>>("RBTree (huge pages)");
+}
+
+/**
+ *  the same for interval keys: contents against Stdmap, and
+ *  for_each_overlap() against a scan of every interval
+ */
+template <typename Tree>
+bool run_interval(const std::uint8_t* data, std::size_t size,
+                  const char* name) {
+  using I = std::pair<K, K>;
+  Input in(data, size);
+  const int key_range = 1 << (4 + in.byte() % 12);
+  auto key = [&]() {
+    int hi = in.byte();
+    int lo = in.byte();
+    return (hi << 8 | lo) % key_range;
+  };
+  // mostly short intervals, so that overlap queries prune subtrees
+  auto interval = [&]() {
+    K lo = key();
+    int len = in.byte();
+    return I(lo, lo + (len % 2 ? len % 8 : len));
+  };
+  auto contents = [](auto& t) {
+    std::vector<std::pair<I, V>> res;
+    t.for_each([&](const I& k, const V& v) { res.emplace_back(k, v); });
+    return res;
+  };
+
+  Tree tree;
+  Stdmap<I, V> ref;
+  std::vector<I> inserted;
+  V next_val = 0;
+  std::size_t step = 0;
+  auto fail = [&](const char* what) {
+    std::fprintf(stderr, "%s: %s mismatch at op %zu\n", name, what, step);
+    return false;
+  };
+
+  while (!in.empty()) {
+    ++step;
+    switch (in.byte() % 9) {
+      case 0:
+      case 1:
+      case 2: {
+        I k = interval();
+        tree.insert(k, next_val);
+        ref.insert(k, next_val);
+        inserted.push_back(k);
+        ++next_val;
+        break;
+      }
+      case 3: {
+        I k = interval();
+        tree.erase(k);
+        ref.erase(k);
+        break;
+      }
+      case 4:
+      case 5: {
+        // an interval inserted before, so that erases mostly hit
+        if (inserted.empty()) break;
+        I k = inserted[key() % inserted.size()];
+        tree.erase(k);
+        ref.erase(k);
+        break;
+      }
+      case 6: {
+        K lo = key(), hi = lo + in.byte();
+        std::vector<std::pair<I, V>> got, expect;
+        tree.for_each_overlap(
+            lo, hi, [&](const I& k, const V& v) { got.emplace_back(k, v); });
+        std::sort(got.begin(), got.end());
+        tree.for_each([&](const I& k, const V& v) {
+          if (!(k.second < lo) && !(hi < k.first)) expect.emplace_back(k, v);
+        });
+        if (got != expect) return fail("overlap");
+        break;
+      }
+      case 7:
+        tree.compact_step(in.byte() % 4);
+        break;
+      case 8:
+        if (!tree.verify()) return fail("invariant");
+        if (contents(tree) != contents(ref)) return fail("content");
+        break;
+    }
+  }
+  if (!tree.verify()) return fail("invariant");
+  if (contents(tree) != contents(ref)) return fail("content");
+  return true;
+}
+
+inline bool run_all(const std::uint8_t* data, std::size_t size) {
+  return run<LLRB<K, V>>(data, size, "LLRB") &&
+         run<RBTree<K, V>>(data, size, "RBTree") &&
+         run<LLRB<K, V, HugePageStorage<>>>(data, size, "LLRB (huge pages)") &&
+         run<RBTree<K, V, HugePageStorage<>>>(data, size,
+                                              "RBTree (huge pages)") &&
+         run<LLRB<K, V, HeapStorage, Sum>>(data, size, "LLRB (sum)") &&
+         run<RBTree<K, V, HeapStorage, Sum>>(data, size, "RBTree (sum)") &&
+         run<CachedTree<RBTree, K, V>>(data, size, "CachedTree<RBTree>") &&
+         run<ShardedLLRB>(data, size, "ShardedTree<LLRB> (range)") &&
+         run<ShardedHashLLRB>(data, size, "ShardedTree<LLRB> (hash)") &&
+         run_interval<IntervalTree<K, V>>(data, size, "IntervalTree") &&
+         run_interval<LLRB<std::pair<K, K>, V, HeapStorage,
+                           IntervalAugment<K, V>>>(data, size,
+                                                   "LLRB (intervals)");
+}
+
+}  // namespace difftest
@@ -0,0 +1,26 @@
+// libFuzzer entry point (clang -fsanitize=fuzzer)
+// built with FUZZ_STANDALONE, main() replays the input files given
+
+#include <cstdlib>
+#include "difftest.hpp"
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data,
+                                      std::size_t size) {
+  if (!difftest::run_all(data, size)) std::abort();
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+#include <fstream>
+#include <iterator>
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    std::ifstream ifs(argv[i], std::ios::binary);
+    std::vector<std::uint8_t> data((std::istreambuf_iterator<char>(ifs)),
+                                   std::istreambuf_iterator<char>());
+    LLVMFuzzerTestOneInput(data.data(), data.size());
+  }
+  return 0;
+}
+#endif
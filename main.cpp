@@ -1,12 +1,172 @@
 #include <bits/stdc++.h>
+#include <omp.h>
+#ifndef ENABLE_TEST
 #define ENABLE_TEST 0
+#endif
+#ifndef ENABLE_SHARDED_BENCH
+#define ENABLE_SHARDED_BENCH 0
+#endif
+#ifndef ENABLE_BATCH_BENCH
+#define ENABLE_BATCH_BENCH 0
+#endif
+#ifndef ENABLE_ZIPF_BENCH
+#define ENABLE_ZIPF_BENCH 0
+#endif
+#ifndef ENABLE_HUGEPAGE_BENCH
+#define ENABLE_HUGEPAGE_BENCH 0
+#endif
+#ifndef ENABLE_AGED_BENCH
+#define ENABLE_AGED_BENCH 0
+#endif
+#ifndef ENABLE_AGGREGATE_BENCH
+#define ENABLE_AGGREGATE_BENCH 0
+#endif
+#ifndef ENABLE_INTERLEAVE_BENCH
+#define ENABLE_INTERLEAVE_BENCH 0
+#endif
+#ifndef ENABLE_LLC_FLUSH
+#define ENABLE_LLC_FLUSH 0
+#endif
 
 #include "stdmap.hpp"
 #include "LLRB.hpp"
 #include "RBTree.hpp"
+#include "ShardedTree.hpp"
+#include "CachedTree.hpp"
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <unistd.h>
 
 using namespace std;
 
+template<typename K, typename V> using LLRBHuge = LLRB<K, V, HugePageStorage<>>;
+template<typename K, typename V> using RBTreeHuge = RBTree<K, V, HugePageStorage<>>;
+template<typename K, typename V> using RBTreeHugeNode0 = RBTree<K, V, HugePageStorage<0>>;
+template<typename K, typename V> using LLRBSum = LLRB<K, V, HeapStorage, SumAugment<K, V, long long>>;
+template<typename K, typename V> using RBTreeSum = RBTree<K, V, HeapStorage, SumAugment<K, V, long long>>;
+
+//! n distinct random keys with random values
+template<typename DTYPE>
+vector<pair<DTYPE,DTYPE>> gen_items(int n, mt19937& mt) {
+  vector<pair<DTYPE,DTYPE>> items(n);
+  unordered_set<DTYPE> memo;
+  for(int i=0;i<n;++i){
+    DTYPE key = mt();
+
+    if(memo.count(key)) --i;
+    else{
+      memo.insert(key);
+      items[i] = make_pair(key, mt());
+    }
+  }
+  return items;
+}
+
+/**
+ * isolation of measurements
+ */
+
+//! untimed trials run before the measured ones
+constexpr int WARMUP_NUM = 2;
+
+//! evict the last level cache by streaming over a buffer larger than it
+void flush_llc() {
+  static vector<char> buf(64 << 20);
+  for(size_t i=0;i<buf.size();i+=64){
+    buf[i] += 1;
+  }
+}
+
+//! pin the calling process to the last cpu it is allowed to run on
+int pin_cpu() {
+  cpu_set_t set;
+  if(sched_getaffinity(0, sizeof(set), &set) != 0) return -1;
+  int cpu = -1;
+  for(int i=0;i<CPU_SETSIZE;++i){
+    if(CPU_ISSET(i, &set)) cpu = i;
+  }
+  if(cpu < 0) return -1;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0 ? cpu : -1;
+}
+
+//! run f() in a forked child pinned to one cpu, so that every tree starts
+//! from a fresh heap. the samples returned by f() come back through a pipe.
+//! falls back to running f() in place if the child cannot be set up.
+template<typename F>
+vector<double> isolated(F f) {
+  int fd[2];
+  if(pipe(fd) != 0) return f();
+
+  cout.flush();
+  pid_t pid = fork();
+  if(pid < 0){
+    close(fd[0]);
+    close(fd[1]);
+    return f();
+  }
+
+  if(pid == 0){
+    close(fd[0]);
+    pin_cpu();
+    vector<double> res = f();
+    size_t len = res.size();
+    bool ok = write(fd[1], &len, sizeof(len)) == sizeof(len);
+    const char* p = reinterpret_cast<const char*>(res.data());
+    size_t rest = len * sizeof(double);
+    while(ok && rest > 0){
+      ssize_t w = write(fd[1], p, rest);
+      if(w <= 0) ok = false;
+      else { p += w; rest -= w; }
+    }
+    cout.flush();
+    _exit(ok ? 0 : 1);
+  }
+
+  close(fd[1]);
+  vector<double> res;
+  size_t len = 0;
+  if(read(fd[0], &len, sizeof(len)) == sizeof(len)){
+    res.resize(len);
+    char* p = reinterpret_cast<char*>(res.data());
+    size_t rest = len * sizeof(double);
+    while(rest > 0){
+      ssize_t r = read(fd[0], p, rest);
+      if(r <= 0) break;
+      p += r;
+      rest -= r;
+    }
+    if(rest > 0) res.clear();
+  }
+  close(fd[0]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) res.clear();
+  return res;
+}
+
+//! half width of the 95% confidence interval of the mean (Student t)
+double ci95(const vector<double>& xs) {
+  static const double t975[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+  };
+  const size_t k = xs.size();
+  if(k < 2) return 0;
+  double avg = accumulate(begin(xs), end(xs), 0.) / k;
+  double var = 0;
+  for(double x : xs) var += (x - avg) * (x - avg);
+  var /= k - 1;
+  double t = k - 1 <= size(t975) ? t975[k - 2] : 1.960;
+  return t * sqrt(var / k);
+}
+
 /**
  * measure functions
  */
@@ -15,13 +175,15 @@ template<typename T, typename K, typename V>
 tuple<double,double,double> run(int n, const vector<pair<K,V>>& items, const vector<pair<K,V>>& eraselist) {
   T tree;
 
-  auto start = chrono::steady_clock::now();
+  auto start1 = chrono::steady_clock::now();
 
   for(auto& item : items) {
     tree.insert(item.first, item.second);
   }
 
   auto stop1 = chrono::steady_clock::now();
+  if(ENABLE_LLC_FLUSH) flush_llc();
+  auto start2 = chrono::steady_clock::now();
 
   bool ok = true;
   for(const auto& item : items) {
@@ -33,6 +195,8 @@ tuple<double,double,double> run(int n, const vector<pair<K,V>>& items, const vec
   }
 
   auto stop2 = chrono::steady_clock::now();
+  if(ENABLE_LLC_FLUSH) flush_llc();
+  auto start3 = chrono::steady_clock::now();
 
   for(const auto& item : eraselist) {
     tree.erase(item.first);
@@ -40,9 +204,9 @@ tuple<double,double,double> run(int n, const vector<pair<K,V>>& items, const vec
 
   auto stop3 = chrono::steady_clock::now();
 
-  auto elapsed1 = chrono::duration_cast<chrono::microseconds>(stop1 - start).count();
-  auto elapsed2 = chrono::duration_cast<chrono::microseconds>(stop2 - stop1).count();
-  auto elapsed3 = chrono::duration_cast<chrono::microseconds>(stop3 - stop2).count();
+  auto elapsed1 = chrono::duration_cast<chrono::microseconds>(stop1 - start1).count();
+  auto elapsed2 = chrono::duration_cast<chrono::microseconds>(stop2 - start2).count();
+  auto elapsed3 = chrono::duration_cast<chrono::microseconds>(stop3 - start3).count();
 
   if(!ok){
     cout << "failed" << endl;
@@ -50,34 +214,43 @@ tuple<double,double,double> run(int n, const vector<pair<K,V>>& items, const vec
   return make_tuple(elapsed1, elapsed2, elapsed3);
 }
 
-template<template<typename,typename> typename T>
+template<template<typename...> typename T>
 void measure(string name, int n, int try_num){
   using DTYPE = int;
   using Tree = T<DTYPE,DTYPE>;
 
   mt19937 mt(123);
-  vector<pair<DTYPE,DTYPE>> items(n);
-  unordered_set<DTYPE> memo;
-  for(int i=0;i<n;++i){
-    DTYPE key = mt();
-
-    if(memo.count(key)) --i;
-    else{
-      memo.insert(key);
-      items[i] = make_pair(key, mt());
-    }
-  }
+  auto items = gen_items<DTYPE>(n, mt);
 
   auto eraselist = items;
   shuffle(begin(eraselist), end(eraselist), mt);
 
+  // each tree runs in its own pinned child; the first WARMUP_NUM trials are dropped
+  auto samples = isolated([&]() {
+    vector<double> res;
+    for(int i=0;i<WARMUP_NUM+try_num;++i){
+      auto time = run<Tree>(n, items, eraselist);
+      if(i < WARMUP_NUM) continue;
+      res.push_back(get<0>(time));
+      res.push_back(get<1>(time));
+      res.push_back(get<2>(time));
+    }
+    return res;
+  });
+  if(samples.size() != 3u * try_num){
+    cout << name << endl << "failed (child process)" << endl;
+    return;
+  }
+
   vector<double> time_ins, time_fnd, time_del;
   for(int i=0;i<try_num;++i){
-    auto time = run<Tree>(n, items, eraselist);
-    time_ins.push_back(get<0>(time));
-    time_fnd.push_back(get<1>(time));
-    time_del.push_back(get<2>(time));
+    time_ins.push_back(samples[3 * i + 0]);
+    time_fnd.push_back(samples[3 * i + 1]);
+    time_del.push_back(samples[3 * i + 2]);
   }
+  double ci_ins = ci95(time_ins);
+  double ci_fnd = ci95(time_fnd);
+  double ci_del = ci95(time_del);
   sort(begin(time_ins), end(time_ins));
   sort(begin(time_fnd), end(time_fnd));
   sort(begin(time_del), end(time_del));
@@ -93,26 +266,509 @@ void measure(string name, int n, int try_num){
        << "              " << "delete = " << time_del[try_num / 2] << " (" << time_del[try_num / 2] * 1. / n << " per item)" << endl
        << "avg    [us] : " << "insert = " << avg_ins << " (" << avg_ins * 1. / n << " per item)" << endl
        << "              " << "find   = " << avg_fnd << " (" << avg_fnd * 1. / n << " per item)" << endl
-       << "              " << "delete = " << avg_del << " (" << avg_del * 1. / n << " per item)" << endl;
+       << "              " << "delete = " << avg_del << " (" << avg_del * 1. / n << " per item)" << endl
+       << "95% CI [us] : " << "insert = " << avg_ins << " +- " << ci_ins << " (" << (avg_ins > 0 ? 100. * ci_ins / avg_ins : 0.) << "%)" << endl
+       << "              " << "find   = " << avg_fnd << " +- " << ci_fnd << " (" << (avg_fnd > 0 ? 100. * ci_fnd / avg_fnd : 0.) << "%)" << endl
+       << "              " << "delete = " << avg_del << " +- " << ci_del << " (" << (avg_del > 0 ? 100. * ci_del / avg_del : 0.) << "%)" << endl;
 }
 
-template<template<typename,typename> typename T>
-bool check(int n){
+/**
+ * multithreaded throughput of ShardedTree
+ */
+
+template<typename Tree, typename K, typename V>
+tuple<double,double,double> run_parallel(Tree& tree, const vector<pair<K,V>>& items, const vector<pair<K,V>>& eraselist) {
+  const int n = items.size();
+
+  auto start = chrono::steady_clock::now();
+
+#pragma omp parallel for schedule(static)
+  for(int i=0;i<n;++i) {
+    tree.insert(items[i].first, items[i].second);
+  }
+
+  auto stop1 = chrono::steady_clock::now();
+
+  int ng = 0;
+#pragma omp parallel for schedule(static) reduction(+:ng)
+  for(int i=0;i<n;++i) {
+    V v = 0;
+    bool found = tree.find(items[i].first, v);
+    if(!found || v != items[i].second) ++ng;
+  }
+
+  auto stop2 = chrono::steady_clock::now();
+
+#pragma omp parallel for schedule(static)
+  for(int i=0;i<n;++i) {
+    tree.erase(eraselist[i].first);
+  }
+
+  auto stop3 = chrono::steady_clock::now();
+
+  auto elapsed1 = chrono::duration_cast<chrono::microseconds>(stop1 - start).count();
+  auto elapsed2 = chrono::duration_cast<chrono::microseconds>(stop2 - stop1).count();
+  auto elapsed3 = chrono::duration_cast<chrono::microseconds>(stop3 - stop2).count();
+
+  if(ng){
+    cout << "failed" << endl;
+  }
+  return make_tuple(elapsed1, elapsed2, elapsed3);
+}
+
+// sweeps the shard count from 1 to 4 * #threads
+template<template<typename...> typename T>
+void measure_sharded(string name, int n, int try_num, bool range){
   using DTYPE = int;
+  using Tree = ShardedTree<T, DTYPE, DTYPE>;
 
-  T<DTYPE,DTYPE> tree;
   mt19937 mt(123);
-  vector<pair<DTYPE,DTYPE>> items(n);
-  unordered_set<DTYPE> memo;
+  auto items = gen_items<DTYPE>(n, mt);
+  auto eraselist = items;
+  shuffle(begin(eraselist), end(eraselist), mt);
+
+  vector<DTYPE> keys;
+  for(const auto& item : items) keys.push_back(item.first);
+
+  cout << name << (range ? " (range)" : " (hash)") << endl;
+
+  const size_t max_shards = 4 * omp_get_max_threads();
+  for(size_t shards = 1; shards <= max_shards; shards *= 2){
+    vector<double> time_ins, time_fnd, time_del;
+    for(int i=0;i<try_num;++i){
+      Tree tree = range ? Tree(Tree::quantiles(keys, shards)) : Tree(shards);
+      auto time = run_parallel(tree, items, eraselist);
+      time_ins.push_back(get<0>(time));
+      time_fnd.push_back(get<1>(time));
+      time_del.push_back(get<2>(time));
+    }
+    sort(begin(time_ins), end(time_ins));
+    sort(begin(time_fnd), end(time_fnd));
+    sort(begin(time_del), end(time_del));
+
+    // items per us == Mops/s
+    cout << fixed << setprecision(3)
+         << "shards = " << setw(3) << shards << " [Mops/s] : "
+         << "insert = " << n / time_ins[try_num / 2]
+         << ", find = " << n / time_fnd[try_num / 2]
+         << ", delete = " << n / time_del[try_num / 2] << endl;
+  }
+}
+
+/**
+ * apply_batch vs per-op application
+ */
+
+// a batch of size m on a tree of size n: half erases of present keys,
+// half inserts of new keys. clustered: the keys are neighbours in the
+// tree, so that the batch spans a small subtree
+template<template<typename...> typename T>
+void measure_batch(string name, int n, int m, int try_num, bool clustered){
+  using DTYPE = int;
+  using Tree = T<DTYPE,DTYPE>;
+  using Op = BatchOp<DTYPE,DTYPE>;
+
+  mt19937 mt(123);
+  auto items = gen_items<DTYPE>(n + m / 2, mt);
+  vector<Op> ops;
+  if(clustered){
+    vector<DTYPE> keys;
+    for(int i=0;i<n;++i) keys.push_back(items[i].first);
+    sort(begin(keys), end(keys));
+    const int len = m - m / 2;
+    const int s = mt() % (n - len + 1);
+    for(int i=0;i<m/2;++i){
+      ops.push_back(Op{Op::Type::Insert, keys[s + i] ^ 1, (DTYPE)mt()});
+    }
+    for(int i=0;i<len;++i){
+      ops.push_back(Op{Op::Type::Erase, keys[s + i], 0});
+    }
+  }else{
+    for(int i=0;i<m/2;++i){
+      const auto& item = items[n + i];
+      ops.push_back(Op{Op::Type::Insert, item.first, item.second});
+    }
+    for(int i=0;i<m-m/2;++i){
+      ops.push_back(Op{Op::Type::Erase, items[mt() % n].first, 0});
+    }
+  }
+  shuffle(begin(ops), end(ops), mt);
+
+  // 0: per op, 1: apply_batch, 2: apply_batch with rebuild
+  vector<double> times[3];
+  for(int i=0;i<try_num;++i){
+    for(int mode=0;mode<3;++mode){
+      Tree tree;
+      for(int j=0;j<n;++j) tree.insert(items[j].first, items[j].second);
+
+      auto start = chrono::steady_clock::now();
+      if(mode == 0){
+        for(const auto& op : ops){
+          if(op.type == Op::Type::Insert) tree.insert(op.key, op.val);
+          else tree.erase(op.key);
+        }
+      }else{
+        tree.apply_batch(ops, mode == 1 ? numeric_limits<double>::infinity() : 0.);
+      }
+      auto stop = chrono::steady_clock::now();
+      times[mode].push_back(chrono::duration_cast<chrono::microseconds>(stop - start).count());
+    }
+  }
+  for(auto& t : times) sort(begin(t), end(t));
+
+  cout << name << (clustered ? " (clustered)" : "") << fixed << setprecision(3)
+       << " m = " << m << " median [us] : "
+       << "per op = " << times[0][try_num / 2]
+       << ", batch = " << times[1][try_num / 2]
+       << ", rebuild = " << times[2][try_num / 2] << endl;
+}
+
+/**
+ * Zipfian lookups, with and without CachedTree
+ */
+
+//! q ranks in [0, n), P(rank = i) is proportional to 1 / (i + 1)^s
+vector<int> zipf_ranks(int n, int q, double s, mt19937& mt) {
+  vector<double> cdf(n);
+  double sum = 0;
   for(int i=0;i<n;++i){
-    DTYPE key = mt();
+    sum += pow(i + 1., -s);
+    cdf[i] = sum;
+  }
+  uniform_real_distribution<double> dist(0, sum);
+  vector<int> res(q);
+  for(auto& r : res){
+    r = min<int>(upper_bound(begin(cdf), end(cdf), dist(mt)) - begin(cdf), n - 1);
+  }
+  return res;
+}
 
-    if(memo.count(key)) --i;
-    else{
-      memo.insert(key);
-      items[i] = make_pair(key, mt());
+template<typename Tree>
+string cache_info(const Tree&) { return ""; }
+
+template<template<typename...> typename T, typename K, typename V>
+string cache_info(const CachedTree<T,K,V>& tree) {
+  const auto& st = tree.stats();
+  ostringstream os;
+  os << fixed << setprecision(3) << ", hit rate = " << st.hit_rate()
+     << " (bypassed " << st.bypassed << ")";
+  return os.str();
+}
+
+template<typename Tree>
+void measure_zipf(string name, int n, int q, double s, int try_num){
+  using DTYPE = int;
+
+  mt19937 mt(123);
+  auto items = gen_items<DTYPE>(n, mt);
+  vector<pair<DTYPE,DTYPE>> queries;
+  for(int r : zipf_ranks(n, q, s, mt)) queries.push_back(items[r]);
+
+  vector<double> time_ins, time_fnd;
+  string info;
+  for(int i=0;i<try_num;++i){
+    Tree tree;
+
+    auto start = chrono::steady_clock::now();
+    for(const auto& item : items) tree.insert(item.first, item.second);
+    auto stop1 = chrono::steady_clock::now();
+
+    bool ok = true;
+    for(const auto& item : queries){
+      DTYPE v = 0;
+      if(!tree.find(item.first, v) || v != item.second) ok = false;
     }
+    auto stop2 = chrono::steady_clock::now();
+
+    if(!ok) cout << "failed" << endl;
+    time_ins.push_back(chrono::duration_cast<chrono::nanoseconds>(stop1 - start).count());
+    time_fnd.push_back(chrono::duration_cast<chrono::nanoseconds>(stop2 - stop1).count());
+    info = cache_info(tree);
+  }
+  sort(begin(time_ins), end(time_ins));
+  sort(begin(time_fnd), end(time_fnd));
+
+  cout << name << fixed << setprecision(3)
+       << " s = " << s << " median [ns per item] : "
+       << "insert = " << time_ins[try_num / 2] / n
+       << ", find = " << time_fnd[try_num / 2] / q << info << endl;
+}
+
+/**
+ * node storage: regular pages vs huge pages
+ */
+
+//! dTLB load misses of this thread, -1 if perf events are unavailable
+struct DtlbCounter {
+  int fd;
+
+  DtlbCounter() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  ~DtlbCounter() { if(fd >= 0) close(fd); }
+
+  void start() {
+    if(fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
   }
+  long long stop() {
+    if(fd < 0) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long res;
+    if(read(fd, &res, sizeof(res)) != sizeof(res)) return -1;
+    return res;
+  }
+};
+
+template<template<typename...> typename T>
+void measure_pages(string name, int n, int try_num){
+  using DTYPE = int;
+  using Tree = T<DTYPE,DTYPE>;
+
+  mt19937 mt(123);
+  auto items = gen_items<DTYPE>(n, mt);
+  auto eraselist = items;
+  shuffle(begin(eraselist), end(eraselist), mt);
+
+  DtlbCounter counter;
+  // [phase] = (time [us], dTLB misses)
+  vector<pair<double,long long>> res[3];
+  for(int i=0;i<try_num;++i){
+    Tree tree;
+
+    auto start = chrono::steady_clock::now();
+    counter.start();
+    for(const auto& item : items) tree.insert(item.first, item.second);
+    long long miss1 = counter.stop();
+    auto stop1 = chrono::steady_clock::now();
+
+    bool ok = true;
+    counter.start();
+    for(const auto& item : items){
+      DTYPE v = 0;
+      if(!tree.find(item.first, v) || v != item.second) ok = false;
+    }
+    long long miss2 = counter.stop();
+    auto stop2 = chrono::steady_clock::now();
+
+    counter.start();
+    for(const auto& item : eraselist) tree.erase(item.first);
+    long long miss3 = counter.stop();
+    auto stop3 = chrono::steady_clock::now();
+
+    if(!ok) cout << "failed" << endl;
+    res[0].emplace_back(chrono::duration_cast<chrono::microseconds>(stop1 - start).count(), miss1);
+    res[1].emplace_back(chrono::duration_cast<chrono::microseconds>(stop2 - stop1).count(), miss2);
+    res[2].emplace_back(chrono::duration_cast<chrono::microseconds>(stop3 - stop2).count(), miss3);
+  }
+  for(auto& r : res) sort(begin(r), end(r));
+
+  const char* phase[] = { "insert", "find  ", "delete" };
+  cout << name << endl;
+  for(int p=0;p<3;++p){
+    const auto& med = res[p][try_num / 2];
+    cout << fixed << setprecision(3)
+         << (p ? "              " : "median [us] : ") << phase[p] << " = " << med.first
+         << " (" << med.first * 1. / n << " per item), dTLB misses = ";
+    if(med.second < 0) cout << "n/a" << endl;
+    else cout << med.second << " (" << med.second * 1. / n << " per item)" << endl;
+  }
+}
+
+/**
+ * aged tree: churn, find, compact, find again
+ */
+
+template<template<typename...> typename T>
+void measure_aged(string name, int n, int try_num){
+  using DTYPE = int;
+  using Tree = T<DTYPE,DTYPE>;
+  constexpr size_t SLICE = 4096;  // nodes per compact_step()
+
+  mt19937 mt(123);
+  auto items = gen_items<DTYPE>(2 * n, mt);
+
+  vector<double> time_aged, time_cmp, time_new;
+  size_t slices = 0;
+  for(int i=0;i<try_num;++i){
+    Tree tree;
+    // items[0, n) are in the tree, items[n, 2n) are not
+    auto pool = items;
+    for(int j=0;j<n;++j) tree.insert(pool[j].first, pool[j].second);
+    auto churn = [&](){
+      int out = mt() % n, in = n + mt() % n;
+      tree.erase(pool[out].first);
+      tree.insert(pool[in].first, pool[in].second);
+      swap(pool[out], pool[in]);
+    };
+    for(int j=0;j<2*n;++j) churn();
+    vector<pair<DTYPE,DTYPE>> queries;
+    auto set_queries = [&](){
+      queries.assign(begin(pool), begin(pool) + n);
+      shuffle(begin(queries), end(queries), mt);
+    };
+    set_queries();
+
+    auto find_all = [&](){
+      bool ok = true;
+      auto start = chrono::steady_clock::now();
+      for(const auto& item : queries){
+        DTYPE v = 0;
+        if(!tree.find(item.first, v) || v != item.second) ok = false;
+      }
+      auto stop = chrono::steady_clock::now();
+      if(!ok) cout << "failed" << endl;
+      return chrono::duration_cast<chrono::microseconds>(stop - start).count();
+    };
+
+    time_aged.push_back(find_all());
+
+    // the tree stays live: one erase and one insert between two slices
+    auto start = chrono::steady_clock::now();
+    slices = 1;
+    while(!tree.compact_step(SLICE)){
+      churn();
+      ++slices;
+    }
+    auto stop = chrono::steady_clock::now();
+    time_cmp.push_back(chrono::duration_cast<chrono::microseconds>(stop - start).count());
+
+    set_queries();
+    time_new.push_back(find_all());
+  }
+  sort(begin(time_aged), end(time_aged));
+  sort(begin(time_cmp), end(time_cmp));
+  sort(begin(time_new), end(time_new));
+
+  cout << name << endl
+       << fixed << setprecision(3)
+       << "median [us] : " << "find (aged)      = " << time_aged[try_num / 2] << " (" << time_aged[try_num / 2] * 1. / n << " per item)" << endl
+       << "              " << "compact          = " << time_cmp[try_num / 2] << " (" << slices << " slices of " << SLICE << " nodes)" << endl
+       << "              " << "find (compacted) = " << time_new[try_num / 2] << " (" << time_new[try_num / 2] * 1. / n << " per item)" << endl;
+}
+
+/**
+ * range sums: aggregate() vs a scan of the range
+ */
+
+template<template<typename...> typename T>
+void measure_aggregate(string name, int n, int width, int q, int try_num){
+  using DTYPE = int;
+  using Tree = T<DTYPE,DTYPE>;
+
+  mt19937 mt(123);
+  auto items = gen_items<DTYPE>(n, mt);
+  vector<DTYPE> keys;
+  for(const auto& item : items) keys.push_back(item.first);
+  sort(begin(keys), end(keys));
+
+  // ranges covering `width` keys
+  vector<pair<DTYPE,DTYPE>> ranges(q);
+  for(auto& r : ranges){
+    int i = mt() % (n - width + 1);
+    r = make_pair(keys[i], keys[i + width - 1]);
+  }
+
+  vector<double> time_ins, time_agg, time_scan;
+  for(int i=0;i<try_num;++i){
+    Tree tree;
+    auto start = chrono::steady_clock::now();
+    for(const auto& item : items) tree.insert(item.first, item.second);
+    auto stop1 = chrono::steady_clock::now();
+
+    long long sum1 = 0;
+    for(const auto& r : ranges) sum1 += tree.aggregate(r.first, r.second);
+    auto stop2 = chrono::steady_clock::now();
+
+    long long sum2 = 0;
+    for(const auto& r : ranges){
+      tree.for_each_range(r.first, r.second, [&](const DTYPE&, const DTYPE& v){ sum2 += v; });
+    }
+    auto stop3 = chrono::steady_clock::now();
+
+    if(sum1 != sum2) cout << "failed" << endl;
+    time_ins.push_back(chrono::duration_cast<chrono::nanoseconds>(stop1 - start).count());
+    time_agg.push_back(chrono::duration_cast<chrono::nanoseconds>(stop2 - stop1).count());
+    time_scan.push_back(chrono::duration_cast<chrono::nanoseconds>(stop3 - stop2).count());
+  }
+  sort(begin(time_ins), end(time_ins));
+  sort(begin(time_agg), end(time_agg));
+  sort(begin(time_scan), end(time_scan));
+
+  cout << name << fixed << setprecision(3)
+       << " width = " << width << " median [ns] : "
+       << "insert = " << time_ins[try_num / 2] / n << " per item"
+       << ", aggregate = " << time_agg[try_num / 2] / q << " per query"
+       << ", scan = " << time_scan[try_num / 2] / q << " per query" << endl;
+}
+
+/**
+ * plain find loop vs coroutine-interleaved lookups
+ */
+
+template<template<typename...> typename T>
+void measure_interleave(string name, int n, int q, int try_num){
+  using DTYPE = int;
+  using Tree = T<DTYPE,DTYPE>;
+  const vector<size_t> widths = { 1, 4, 8, 16, 32 };
+
+  mt19937 mt(123);
+  auto items = gen_items<DTYPE>(n, mt);
+  Tree tree;
+  for(const auto& item : items) tree.insert(item.first, item.second);
+
+  vector<DTYPE> keys(q);
+  for(auto& k : keys) k = items[mt() % n].first;
+  vector<DTYPE> res(q);
+  unique_ptr<bool[]> found(new bool[q]);
+
+  vector<double> time_plain;
+  vector<vector<double>> time_inter(widths.size());
+  for(int i=0;i<try_num;++i){
+    auto start = chrono::steady_clock::now();
+    int hits = 0;
+    for(int j=0;j<q;++j) hits += tree.find(keys[j], res[j]);
+    auto stop = chrono::steady_clock::now();
+    if(hits != q) cout << "failed" << endl;
+    time_plain.push_back(chrono::duration_cast<chrono::nanoseconds>(stop - start).count());
+
+    for(size_t w=0;w<widths.size();++w){
+      auto start = chrono::steady_clock::now();
+      size_t hits = find_interleaved(tree, keys.data(), q, res.data(), found.get(), widths[w]);
+      auto stop = chrono::steady_clock::now();
+      if(hits != size_t(q)) cout << "failed" << endl;
+      time_inter[w].push_back(chrono::duration_cast<chrono::nanoseconds>(stop - start).count());
+    }
+  }
+  sort(begin(time_plain), end(time_plain));
+  for(auto& t : time_inter) sort(begin(t), end(t));
+
+  cout << name << fixed << setprecision(3)
+       << " median [ns per lookup] : find = " << time_plain[try_num / 2] / q;
+  for(size_t w=0;w<widths.size();++w){
+    cout << ", width " << widths[w] << " = " << time_inter[w][try_num / 2] / q;
+  }
+  cout << endl;
+}
+
+template<template<typename...> typename T>
+bool check(int n){
+  using DTYPE = int;
+
+  T<DTYPE,DTYPE> tree;
+  mt19937 mt(123);
+  auto items = gen_items<DTYPE>(n, mt);
 
   for(const auto& item : items) {
     tree.insert(item.first, item.second);
@@ -139,17 +795,116 @@ int main() {
     cout << "test LLRB ..." << endl;
     if(!check<LLRB>(12345)) cout << "LLRB failed" << endl;
     cout << "test RBTree ..." << endl;
-    if(!check<RBTree>(12345)) cout << "LLRB failed" << endl;
+    if(!check<RBTree>(12345)) cout << "RBTree failed" << endl;
     return 0;
   }
 #endif
 
   constexpr int TRY_NUM = 10;
 
+#if ENABLE_INTERLEAVE_BENCH
+  {
+    constexpr int QUERY_NUM = 1000000;
+    for(int n : { 1000000, 10000000 }) {
+      cout << "n = " << n << endl;
+      measure_interleave<LLRB>("LLRB", n, QUERY_NUM, TRY_NUM);
+      measure_interleave<RBTree>("RBTree", n, QUERY_NUM, TRY_NUM);
+    }
+    return 0;
+  }
+#endif
+
+#if ENABLE_AGGREGATE_BENCH
+  {
+    constexpr int QUERY_NUM = 1000;
+    for(int n : { 100000, 1000000 }) {
+      cout << "n = " << n << endl;
+      for(int width : { 10, 1000, 100000 }) {
+        measure_aggregate<LLRBSum>("LLRB", n, width, QUERY_NUM, TRY_NUM);
+        measure_aggregate<RBTreeSum>("RBTree", n, width, QUERY_NUM, TRY_NUM);
+      }
+    }
+    return 0;
+  }
+#endif
+
+#if ENABLE_AGED_BENCH
+  {
+    for(int n : { 100000, 1000000 }) {
+      cout << "n = " << n << endl;
+      measure_aged<LLRB>("LLRB", n, TRY_NUM);
+      measure_aged<RBTree>("RBTree", n, TRY_NUM);
+    }
+    return 0;
+  }
+#endif
+
+#if ENABLE_HUGEPAGE_BENCH
+  {
+    for(int n : { 1000000, 10000000 }) {
+      cout << "n = " << n << endl;
+      measure_pages<LLRB>("LLRB", n, TRY_NUM);
+      measure_pages<LLRBHuge>("LLRB (huge pages)", n, TRY_NUM);
+      measure_pages<RBTree>("RBTree", n, TRY_NUM);
+      measure_pages<RBTreeHuge>("RBTree (huge pages)", n, TRY_NUM);
+      measure_pages<RBTreeHugeNode0>("RBTree (huge pages, NUMA node 0)", n, TRY_NUM);
+    }
+    return 0;
+  }
+#endif
+
+#if ENABLE_ZIPF_BENCH
+  {
+    constexpr int QUERY_NUM = 1000000;
+    for(int n : { 100000, 1000000 }) {
+      cout << "n = " << n << endl;
+      for(double s : { 0.0, 0.99, 1.2 }) {
+        measure_zipf<LLRB<int,int>>("LLRB", n, QUERY_NUM, s, TRY_NUM);
+        measure_zipf<CachedTree<LLRB,int,int>>("LLRB + cache", n, QUERY_NUM, s, TRY_NUM);
+        measure_zipf<RBTree<int,int>>("RBTree", n, QUERY_NUM, s, TRY_NUM);
+        measure_zipf<CachedTree<RBTree,int,int>>("RBTree + cache", n, QUERY_NUM, s, TRY_NUM);
+      }
+    }
+    return 0;
+  }
+#endif
+
+#if ENABLE_BATCH_BENCH
+  {
+    for(int n : { 100000, 1000000 }) {
+      cout << "n = " << n << endl;
+      for(int m : { n / 1000, n / 100, n / 10, n }) {
+        for(bool clustered : { false, true }) {
+          measure_batch<LLRB>("LLRB", n, m, TRY_NUM, clustered);
+          measure_batch<RBTree>("RBTree", n, m, TRY_NUM, clustered);
+        }
+      }
+    }
+    return 0;
+  }
+#endif
+
+#if ENABLE_SHARDED_BENCH
+  {
+    cout << "threads = " << omp_get_max_threads() << endl;
+    for(int n : { 100000, 1000000 }) {
+      cout << "n = " << n << endl;
+      for(bool range : { false, true }) {
+        measure_sharded<Stdmap>("std::map", n, TRY_NUM, range);
+        measure_sharded<LLRB>("LLRB", n, TRY_NUM, range);
+        measure_sharded<RBTree>("RBTree", n, TRY_NUM, range);
+      }
+    }
+    return 0;
+  }
+#endif
+
   vector<int> sizes = { 100, 1000, 10000, 100000, 1000000, 10000000 };
   // vector<int> sizes = { 1000 };
   sort(begin(sizes), end(sizes));
 
+  cout << "warmup = " << WARMUP_NUM << ", trials = " << TRY_NUM
+       << ", llc flush = " << (ENABLE_LLC_FLUSH ? "on" : "off") << endl;
   for(auto n : sizes) {
     cout << "n = " << n << endl;
 
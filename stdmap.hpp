@@ -19,4 +19,10 @@ class Stdmap : public TreeAbst<K, V> {
     res = it->second;
     return true;
   }
+
+  //! visit all (key, val) in ascending order of key
+  template <typename F>
+  void for_each(F f) {
+    for (const auto& kv : mp) f(kv.first, kv.second);
+  }
 };
\ No newline at end of file